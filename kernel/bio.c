@@ -3,11 +3,15 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "memlayout.h"
+#include "slab.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
 
-#define NBUCKET 13
+#define MINBUCKET 16
+#define MAXBUCKET 256   // 桶数都是 2 的幂
+#define BUCKETLOAD 4    // 每个桶平均的块数；超过它的两倍时桶数翻倍
 
 // struct {
 //   struct spinlock lock;
@@ -17,13 +21,68 @@
 //   struct buf head;
 // } bcache;
 
-// 创建哈希表，锁，和hash函数
+// 哈希表的一个桶。每个桶有三条链表：
+//   chain ：散列到这个桶的所有缓存块（通过 prev/next 相连，以0结尾）
+//   a1/am ：其中引用计数为0的块，按释放的先后排列（通过 lprev/lnext 相连，
+//           表头最久没用）。装入后只被读过一次的块在 a1，被再次读到的块升到 am（2Q）。
+//           a1 至少占空闲块的 A1PCT% 时从 a1 替换，否则从 am 替换，
+//           所以一次大的顺序扫描只会挤掉 a1 里的块，am 里常用的
+//           inode、位图和目录块留在缓存中。标记为流式读（BREAD_STREAM）
+//           的块放在 a1 的最前面，最先被替换，也不会升到 am。
+// 后面是供 bcachestat 设备使用的统计，计数在持有桶锁时更新，耗时用原子加。
+struct bucket {
+  struct spinlock lock;
+  struct buf *chain;
+  struct buf *a1, *a1tail;
+  struct buf *am, *amtail;
+  int nfree;    // a1 和 am 链表中的块数
+  int na1;      // 其中在 a1 中的块数
+  uint hit;     // bget() 在桶里找到了块
+  uint miss;    // 没找到，装入了新块
+  uint steal;   // 装入时用的是从别的桶偷来的空闲块
+  uint evict;   // 从本桶替换出去的块
+  uint nget;    // bget() 的次数
+  uint64 time;  // bget() 的总耗时（time 计数器），包括等缓存块锁的时间
+};
+
+// 缓存块按 (dev, blockno) 散列到 nbucket 个桶里，每个桶都有一个锁用于同步。
+// 桶里没有空闲块时，用一个全局的时钟指针轮流找下一个有空闲块的桶，
+// 从它那里偷最久没用的块，只同时持有两个桶的锁。
+//
+// 缓存块从 slab 中按需分配：找不到空闲块时，块数还没到 maxbuf 就新分配一个，
+// 到了上限或者分配失败才去偷。内存紧张时 kalloc() 调用 bshrink()
+// 释放空闲块，但不低于 minbuf。上下限可以用 bcachelimit 系统调用修改。
+//
+// 桶数在启动时按 NBUF 定下来；块数增长到平均每个桶超过 2*BUCKETLOAD 块时，
+// brehash() 把桶数翻倍（最多 MAXBUCKET），重新分配所有缓存块。桶数只增不减。
 struct {
-  struct spinlock lock[NBUCKET]; // 每个桶都有一个锁用于同步
-  // 实际的缓冲区；这些缓冲区会根据哈希函数的计算结果被放入相应的桶中。
-  struct buf buf[NBUF]; 
-  struct buf head[NBUCKET];
-} bcache; // 包含了缓冲区哈希表，使用了哈希桶的方式，共有 NBUCKET 个桶
+  struct bucket bucket[MAXBUCKET];
+  int nbucket;        // 当前的桶数，只在持有全部桶锁时修改
+  // 实际的缓冲区从这里分配；这些缓冲区会根据哈希函数的计算结果被放入相应的桶中。
+  struct kmem_cache cache;
+  int nbuf;           // 当前的缓存块个数
+  int minbuf;         // 个数的下限和上限
+  int maxbuf;
+  uint hand;          // 时钟指针：下一次从哪个桶开始找空闲块
+} bcache;
+
+// 预读统计，用原子操作更新
+struct {
+  int issued; // 发出的预读
+  int hit;    // bread() 找到的块是预读装入的（已读完或正在读）
+  int miss;   // bread() 只能同步读盘
+  int wasted; // 预读装入的块还没用就被替换了
+} rastat;
+
+// 按类别统计的替换次数
+struct {
+  int a1;     // 只读过一次的块
+  int am;     // 被再次读到过的块
+  int stream; // 流式读的块（也计入 a1）
+} evstat;
+
+#define A1PCT 25
+#define BSHRINK 16    // bshrink() 一次最多释放的块数
 
 /*
   哈希桶是一种数据结构，用于实现哈希表。
@@ -39,9 +98,47 @@ struct {
   在每个桶中使用链表等结构来存储数据，可以方便地处理冲突，不需要在整个哈希表中进行复杂的数据移动或重排。
 */
 
-// 使用哈希函数计算块号对应的哈希桶
-int hash (int n) {
-  return n % NBUCKET;
+// 使用哈希函数计算 (dev, blockno) 对应的哈希桶。
+// 先把设备号乘上黄金分割常数混进块号，再用 murmur3 的 fmix32 打散，
+// 取低位：日志区、inode 区和位图这些按固定间隔访问的块也能均匀地分到各个桶。
+static int
+bhash(uint dev, uint blockno)
+{
+  uint x = blockno ^ (dev * 0x9e3779b9);
+
+  x ^= x >> 16;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35;
+  x ^= x >> 16;
+  return x & (bcache.nbucket - 1);
+}
+
+// 锁住 (dev, blockno) 所在的桶并返回它。等锁的时候桶数可能翻倍了，
+// 所以拿到锁之后要确认块还散列到这个桶。
+static struct bucket*
+lockhash(uint dev, uint blockno)
+{
+  for(;;){
+    int id = bhash(dev, blockno);
+    acquire(&bcache.bucket[id].lock);
+    if(id == bhash(dev, blockno))
+      return &bcache.bucket[id];
+    release(&bcache.bucket[id].lock);
+  }
+}
+
+// 锁住缓存块 b 所在的桶并返回它。b->bucket 只在 brehash() 中改变。
+static struct bucket*
+lockbuf(struct buf *b)
+{
+  for(;;){
+    int id = b->bucket;
+    acquire(&bcache.bucket[id].lock);
+    if(id == b->bucket)
+      return &bcache.bucket[id];
+    release(&bcache.bucket[id].lock);
+  }
 }
 
 //辅助函数，用于写cache
@@ -65,9 +162,181 @@ write_cache(struct buf *take_buf, uint dev, uint blockno)
   
   // 将缓存块的引用计数设置为1，表示有一个引用指向该缓存块
   take_buf->refcnt = 1;
-  
-  // 更新缓存块的时间戳，使用当前系统时钟滴答数（ticks）
-  take_buf->time = ticks;
+
+  take_buf->hot = 0;
+  take_buf->used = 0;
+  take_buf->stream = 0;
+
+  if(take_buf->ra){
+    __sync_fetch_and_add(&rastat.wasted, 1);
+    take_buf->ra = 0;
+  }
+}
+
+// 把空闲块 b 从桶 bk 的 a1 或 am 链表中摘下。调用者持有 bk->lock。
+static void
+lru_remove(struct bucket *bk, struct buf *b)
+{
+  struct buf **head = b->hot ? &bk->am : &bk->a1;
+  struct buf **tail = b->hot ? &bk->amtail : &bk->a1tail;
+
+  if(b->lprev)
+    b->lprev->lnext = b->lnext;
+  else
+    *head = b->lnext;
+  if(b->lnext)
+    b->lnext->lprev = b->lprev;
+  else
+    *tail = b->lprev;
+  bk->nfree--;
+  if(!b->hot)
+    bk->na1--;
+}
+
+// 把刚变为空闲的块 b 放到桶 bk 的 am 或 a1 链表尾部（最近使用的一端）；
+// 流式读的块放在 a1 的最前面。调用者持有 bk->lock。
+static void
+lru_append(struct bucket *bk, struct buf *b)
+{
+  struct buf **head = b->hot ? &bk->am : &bk->a1;
+  struct buf **tail = b->hot ? &bk->amtail : &bk->a1tail;
+
+  if(b->stream && !b->hot){
+    b->lprev = 0;
+    b->lnext = *head;
+  } else {
+    b->lprev = *tail;
+    b->lnext = 0;
+  }
+  if(b->lprev)
+    b->lprev->lnext = b;
+  else
+    *head = b;
+  if(b->lnext)
+    b->lnext->lprev = b;
+  else
+    *tail = b;
+  bk->nfree++;
+  if(!b->hot)
+    bk->na1++;
+}
+
+// 从桶 bk 的空闲块中选一个替换掉并摘下；桶里必须有空闲块。
+// 调用者持有 bk->lock。
+static struct buf*
+victim(struct bucket *bk)
+{
+  struct buf *b;
+
+  if(bk->na1 > 0 && bk->na1*100 >= A1PCT*bk->nfree)
+    b = bk->a1;
+  else
+    b = bk->am;
+  lru_remove(bk, b);
+  if(b->dev){
+    bk->evict++;
+    if(b->hot)
+      evstat.am++;
+    else
+      evstat.a1++;
+    if(b->stream)
+      evstat.stream++;
+  }
+  return b;
+}
+
+// 把块 b 挂到桶 bk 的散列链表上。调用者持有 bk->lock。
+static void
+chain_insert(struct bucket *bk, struct buf *b)
+{
+  b->prev = 0;
+  b->next = bk->chain;
+  if(b->next)
+    b->next->prev = b;
+  bk->chain = b;
+  b->bucket = bk - bcache.bucket;
+}
+
+// 把块 b 从桶 bk 的散列链表上摘下。调用者持有 bk->lock。
+static void
+chain_remove(struct bucket *bk, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bk->chain = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+// 把桶数翻倍，按新的散列重新分配所有缓存块。
+// 按下标顺序拿到全部桶锁（包括新的），所以别人要么还没开始，
+// 要么在 lockhash()/lockbuf() 里等着，拿到锁后会发现桶变了。
+// 空闲块保持原来在各桶 a1/am 中的先后次序；还没装入过的块（dev 0）轮流放。
+// 调用者不能持有桶的锁。
+static void
+brehash(void)
+{
+  struct buf *b, *next, *busy = 0, *free = 0, *freetail = 0;
+  struct bucket *bk;
+  int n, i, rr = 0;
+
+  n = bcache.nbucket;
+  if(2*n > MAXBUCKET)
+    return;
+  for(i = 0; i < n; i++)
+    acquire(&bcache.bucket[i].lock);
+  if(bcache.nbucket != n || bcache.nbuf <= n*BUCKETLOAD*2){
+    // 别人已经翻倍过了
+    for(i = n-1; i >= 0; i--)
+      release(&bcache.bucket[i].lock);
+    return;
+  }
+  for(i = n; i < 2*n; i++){
+    memset(&bcache.bucket[i], 0, sizeof(bcache.bucket[i]));
+    initlock(&bcache.bucket[i].lock, "bcache.hash");
+    acquire(&bcache.bucket[i].lock);
+  }
+
+  // 把所有块摘下来：正在使用的借用 next 串进 busy，空闲的借用 lnext 串进 free
+  for(i = 0; i < n; i++){
+    bk = &bcache.bucket[i];
+    for(b = bk->chain; b; b = next){
+      next = b->next;
+      if(b->refcnt > 0){
+        b->next = busy;
+        busy = b;
+      }
+    }
+    for(int k = 0; k < 2; k++){
+      for(b = k == 0 ? bk->a1 : bk->am; b; b = next){
+        next = b->lnext;
+        b->lnext = 0;
+        if(freetail)
+          freetail->lnext = b;
+        else
+          free = b;
+        freetail = b;
+      }
+    }
+    bk->chain = bk->a1 = bk->a1tail = bk->am = bk->amtail = 0;
+    bk->nfree = bk->na1 = 0;
+  }
+
+  bcache.nbucket = 2*n;
+  for(b = busy; b; b = next){
+    next = b->next;
+    chain_insert(&bcache.bucket[bhash(b->dev, b->blockno)], b);
+  }
+  for(b = free; b; b = next){
+    next = b->lnext;
+    bk = &bcache.bucket[b->dev ? bhash(b->dev, b->blockno) : rr++ & (2*n-1)];
+    chain_insert(bk, b);
+    lru_append(bk, b);
+  }
+
+  for(i = 2*n-1; i >= 0; i--)
+    release(&bcache.bucket[i].lock);
 }
 
 // void
@@ -87,154 +356,454 @@ write_cache(struct buf *take_buf, uint dev, uint blockno)
 //   }
 // }
 
-// 跟上一实验一样的做法，初始化锁并将所有块挂在第一个池子里
-// 初始化缓冲区
+// 分配一个新的缓存块，作为空闲块放进桶 id；块数多到需要时把桶数翻倍。
+// 块数已经到了上限或者内存不够时返回0。调用者不能持有桶的锁。
+static int
+bgrow(int id)
+{
+  struct buf *b;
+  struct bucket *bk = &bcache.bucket[id];
+
+  if(bcache.nbuf >= bcache.maxbuf)
+    return 0;
+  if((b = kmem_cache_alloc(&bcache.cache)) == 0)
+    return 0;
+  memset(b, 0, sizeof(*b));
+  // 还没有装入任何块，dev 0 不会被查到，放在哪个桶都可以
+  initsleeplock(&b->lock, "buffer");
+  __sync_fetch_and_add(&bcache.nbuf, 1);
+
+  acquire(&bk->lock);
+  chain_insert(bk, b);
+  lru_append(bk, b);
+  release(&bk->lock);
+
+  if(bcache.nbuf > bcache.nbucket*BUCKETLOAD*2)
+    brehash();
+  return 1;
+}
+
+// 释放最多 n 个空闲缓存块，但不低于 minbuf，返回释放的个数。
+// 可能在 kalloc() 中被调用，本cpu已经持有的锁不能再拿：
+// 正在给缓存块分配 slab 时直接返回，持有锁的桶跳过。
+static int
+btrim(int n)
+{
+  struct buf *b, *freed = 0;
+  struct bucket *bk;
+  int tot = 0;
+
+  push_off();
+  if(holding(&bcache.cache.lock)){
+    pop_off();
+    return 0;
+  }
+  for(int j = 0; j < bcache.nbucket && tot < n; j++){
+    bk = &bcache.bucket[j];
+    if(holding(&bk->lock))
+      continue;
+    acquire(&bk->lock);
+    while(tot < n && bk->nfree > 0 && bcache.nbuf > bcache.minbuf){
+      b = victim(bk);
+      chain_remove(bk, b);
+      __sync_fetch_and_sub(&bcache.nbuf, 1);
+      b->lnext = freed; // 借用 lnext 串起来，放掉桶锁之后再释放
+      freed = b;
+      tot++;
+    }
+    release(&bk->lock);
+  }
+
+  while((b = freed) != 0){
+    freed = b->lnext;
+    if(b->ra)
+      __sync_fetch_and_add(&rastat.wasted, 1);
+#ifdef LAB_LOCK
+    freelock(&b->lock.lk);
+#endif
+    kmem_cache_free(&bcache.cache, b);
+  }
+  if(tot > 0)
+    kmem_cache_drain(&bcache.cache); // 让空出来的 slab 页回到 kalloc
+  pop_off();
+  return tot;
+}
+
+// 内存不够时由 kalloc() 调用，释放一些空闲的缓存块。
+// 返回释放的块数，0 表示没有可以释放的了。
+int
+bshrink(void)
+{
+  return btrim(BSHRINK);
+}
+
+// 设置缓存块个数的下限和上限，<= 0 的参数表示不变。
+// 下限不能低于 BUFMIN，上限不能低于下限；块数马上调整到范围之内
+// （正在使用的块要等它们空闲之后才会被释放）。
+// 返回调整后的块数，参数不对时返回 -1。
+int
+bsetlimit(int min, int max)
+{
+  if(min <= 0)
+    min = bcache.minbuf;
+  if(max <= 0)
+    max = bcache.maxbuf;
+  if(min < BUFMIN || max < min)
+    return -1;
+  bcache.minbuf = min;
+  bcache.maxbuf = max;
+  for(int i = 0; bcache.nbuf < min; i++)
+    if(!bgrow(i & (bcache.nbucket - 1)))
+      break;
+  if(bcache.nbuf > max)
+    btrim(bcache.nbuf - max);
+  return bcache.nbuf;
+}
+
+// 初始化锁，分配 NBUF 个缓存块，平均分到各个桶里，一开始都是空闲的。
+// 桶数取不小于 NBUF/BUCKETLOAD 的 2 的幂。
 /*
-  最终，整个缓冲区就以哈希桶的形式组织，每个桶都有一个锁用于同步，并且所有缓存块通过链表连接在第一个哈希桶上。
+  最终，整个缓冲区就以哈希桶的形式组织，每个桶都有一个锁用于同步。
   这样的布局有助于提高缓冲区的查找效率和并发访问的性能。
 */
 void
 binit(void)
+{
+  bcache.nbucket = MINBUCKET;
+  while(bcache.nbucket < MAXBUCKET && bcache.nbucket*BUCKETLOAD < NBUF)
+    bcache.nbucket *= 2;
+  for (int i = 0; i < bcache.nbucket; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.hash");
+  kmem_cache_init(&bcache.cache, "bcache", sizeof(struct buf));
+  // 默认最多用八分之一的内存
+  bcache.minbuf = BUFMIN;
+  bcache.maxbuf = (PHYSTOP - KERNBASE) / 8 / sizeof(struct buf);
+  for (int i = 0; i < NBUF; i++)
+    if(!bgrow(i & (bcache.nbucket - 1)))
+      panic("binit");
+}
+
+// 在桶 bk 中查找 (dev, blockno)，找到就增加引用计数（预读时 ra 非0，
+// 找到说明已经在缓存中，什么也不做，返回0）；
+// 否则若桶里有空闲块，就用最久没用的那个装这个块。
+// 调用者持有 bk->lock。*cached 表示块是否已在缓存中。
+static struct buf*
+bget_bucket(struct bucket *bk, uint dev, uint blockno, int ra, int *cached)
 {
   struct buf *b;
 
-  for (int i = 0; i < NBUCKET; i++) {
-    initlock(&(bcache.lock[i]), "bcache.hash");
+  *cached = 0;
+  for(b = bk->chain; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      *cached = 1;
+      if(ra)
+        return 0;
+      bk->hit++;
+      if(b->refcnt++ == 0)
+        lru_remove(bk, b);
+      return b;
+    }
   }
-  // 将第一个哈希桶的头指针指向第一个缓存块
-  bcache.head[0].next = &bcache.buf[0];
-  // 循环遍历所有的缓存块，将它们连接成一个链表
-  for (b = bcache.buf; b < bcache.buf+NBUF-1; b++) {
-    // 当前缓存块的 next 指针指向下一个缓存块
-    b->next = b+1;
-    // 对每个缓存块的锁进行初始化
-    initsleeplock(&b->lock, "buffer");
+  if(bk->nfree > 0){
+    b = victim(bk);
+    write_cache(b, dev, blockno);
+    bk->miss++;
+    return b;
   }
-  initsleeplock(&b->lock, "buffer");
+  return 0;
+}
+
+// 锁住 bget() 找到的缓存块。shared 非0 时，内容有效就以共享方式锁住；
+// 否则（或者还没读进来）独占地锁住，由调用者去读。
+static void
+buflock(struct buf *b, int shared)
+{
+  if(shared){
+    acquiresleep_shared(&b->lock);
+    if(b->valid)
+      return;
+    releasesleep_shared(&b->lock);
+  }
+  acquiresleep(&b->lock);
 }
 
 // 查看缓冲区缓存以查找设备开发上的块。
 // 如果没有找到，则分配一个缓冲区。
-// 无论哪种情况，都返回锁定的缓冲区。
+// 无论哪种情况，都返回锁定的缓冲区（见 buflock()）。
+// 预读时（ra 非0）只在块不在缓存中时才分配，否则返回0；没有空闲块时也返回0。
 // w：分配内存区域，类似 malloc
 static struct buf*
-bget(uint dev, uint blockno)
-{
-  struct buf *b; // 迭代访问缓冲区链表的指针，是当前遍历到的缓存块
-  struct buf *last_b; // 记录上一个缓冲区的指针，以便后续插入操作
-  struct buf *take_buf = 0; // 记录将要被替换的缓冲区
-  int id = hash(blockno); // 用哈希函数计算出块号对应的哈希桶
-  acquire(&bcache.lock[id]); // 获取对当前哈希桶的锁，确保在缓冲区操作期间不会被其他线程中断。
-
-  // 从哈希桶的头节点开始遍历缓冲区链表
-  for(b = bcache.head[id].next, last_b = &(bcache.head[id]); b; b = b->next, last_b = last_b->next)
-  {
-    if(b->dev == dev && b->blockno == blockno)
-    {
-      b->refcnt++; // 增加引用计数
-      release(&bcache.lock[id]); // 释放哈希桶的锁
-      acquiresleep(&b->lock); // 获取缓存块的锁，来对这个缓存块进行操作，例如增加引用计数（b->refcnt++）或者写入新的数据。
+bfind(uint dev, uint blockno, int ra, int shared)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int cached, id;
+
+  bk = lockhash(dev, blockno); // 用哈希函数找到块对应的哈希桶并锁住
+  b = bget_bucket(bk, dev, blockno, ra, &cached);
+  release(&bk->lock);
+  if(cached && b == 0)
+    return 0;
+  if(b){
+    buflock(b, shared);
+    return b;
+  }
+
+  // 本桶没有空闲块：还没到上限就新分配一个放进本桶，再找一次
+  if(bgrow(bk - bcache.bucket)){
+    bk = lockhash(dev, blockno);
+    b = bget_bucket(bk, dev, blockno, ra, &cached);
+    release(&bk->lock);
+    if(cached && b == 0)
+      return 0;
+    if(b){
+      buflock(b, shared);
       return b;
     }
-    if(b->refcnt == 0)
-    {
-      take_buf = b;
-    }
   }
 
-  // bget是获取缓冲区，如果当前缓冲区上没有对应的块，就找到桶中最后一个引用为 0的缓存块，初始化后返回。
-  if(take_buf) // 存在引用计数为零的缓冲区块 take_buf
-  {
-    write_cache(take_buf, dev, blockno); // 则调用 write_cache 将其初始化
-    release(&bcache.lock[id]); // 释放哈希桶的锁
-    acquiresleep(&take_buf->lock); // 获取缓存块的锁
-    return take_buf;
+  // 还是没有：沿着时钟指针找一个有空闲块的桶 j，从那里偷一个。
+  // nfree 是不加锁读的，只用来跳过空桶；按下标顺序锁住 id 和 j 之后再确认。
+  // 桶数翻倍之后块可能不再散列到 id，从头再找。
+  id = bk - bcache.bucket;
+  for(int n = 0; n < 2*bcache.nbucket; n++){
+    int j = __sync_fetch_and_add(&bcache.hand, 1) & (bcache.nbucket - 1);
+    if(j == id || bcache.bucket[j].nfree == 0)
+      continue;
+
+    int lo = id < j ? id : j;
+    int hi = id < j ? j : id;
+    acquire(&bcache.bucket[lo].lock);
+    acquire(&bcache.bucket[hi].lock);
+    if(bhash(dev, blockno) != id){
+      release(&bcache.bucket[hi].lock);
+      release(&bcache.bucket[lo].lock);
+      return bfind(dev, blockno, ra, shared);
+    }
+    // 放掉锁的这段时间里，别人可能已经把这个块装进来了，或者本桶有了空闲块
+    if((b = bget_bucket(bk, dev, blockno, ra, &cached)) == 0 && !cached &&
+       bcache.bucket[j].nfree > 0){
+      b = victim(&bcache.bucket[j]);
+      chain_remove(&bcache.bucket[j], b); // 从桶 j 的散列链表移到桶 id
+      chain_insert(bk, b);
+      write_cache(b, dev, blockno);
+      bk->miss++;
+      bk->steal++;
+    }
+    release(&bcache.bucket[hi].lock);
+    release(&bcache.bucket[lo].lock);
+    if(cached && b == 0)
+      return 0;
+    if(b){
+      buflock(b, shared);
+      return b;
+    }
   }
+  if(ra)
+    return 0;
+  panic("bget: no buffers");
+}
 
-  // 从哈希桶中选择一个空闲的缓冲区块（b->refcnt == 0）以便后续使用
-  int lock_num = -1;
-  uint time = __UINT32_MAX__;
-  struct buf *last_take = 0;
-  struct buf *tmp;
-
-  // 选定了一个引用计数为零且时间戳最小的缓冲区块 take_buf
-  for(int i = 1; i <= NBUCKET/2; ++i)
-  {
-    // 循环中选择的哈希桶索引是连续的，避免在哈希桶数组中出现跳跃式的访问
-    int j = id - i >=0 ? id - i : id + (NBUCKET - i); // 当前要访问的哈希桶的索引
-    // 写成 int j = (id + i)%NBUCKET; 也可以,但取模运算可能带来的性能开销。
-
-    acquire(&bcache.lock[j]); // 获取当前哈希桶的锁
-
-    // 在当前哈希桶中的缓冲区链表上进行遍历，寻找引用计数为零的缓冲区块
-    for(b = bcache.head[j].next, tmp = &(bcache.head[j]); b; b = b->next, tmp = tmp->next)
-    {
-      if (b->refcnt == 0) // 如果找到引用计数为零的缓冲区块
-      {
-        if (b->time < time) // 并且其时间戳比记录的时间戳 time 更小，记录相关信息
-        {
-          time = b->time;
-          last_take = tmp;
-          take_buf = b;
-
-          // 如果之前已经锁住了其他哈希桶，且之前的锁是被持有的状态（holding()返回非零值），释放之前的锁
-          if (lock_num != -1 && lock_num != j && holding(&bcache.lock[lock_num])) 
-            release(&bcache.lock[lock_num]);
-
-          // 记录当前锁住的哈希桶索引
-          lock_num = j;
-        }   
-      }
-    }
+// bfind() 加上耗时统计（预读不计），记在块现在所在的桶上。
+static struct buf*
+bget(uint dev, uint blockno, int ra, int shared)
+{
+  struct buf *b;
+  uint64 t0;
+
+  if(ra)
+    return bfind(dev, blockno, ra, shared);
+  t0 = r_time();
+  b = bfind(dev, blockno, ra, shared);
+  struct bucket *bk = &bcache.bucket[b->bucket];
+  __sync_fetch_and_add(&bk->nget, 1);
+  __sync_fetch_and_add(&bk->time, r_time() - t0);
+  return b;
+}
 
-    // 如果当前哈希桶索引 j 不等于初始哈希桶索引 id，且之前锁住了其他哈希桶索引 lock_num，且之前的锁是被持有的状态，就释放之前的锁
-    // 其实是对当前循环中的桶的检查，如果它里面没有 引用计数为零且时间戳最小的缓冲区块，就释放它的锁
-    if (j != id && j != lock_num && holding(&bcache.lock[j])) 
-      release(&bcache.lock[j]);
+// 对块号从 blockno 开始的 n 个块中不在缓存里的那些分配缓存块并发出异步读，
+// 不等待读完；连续的块由请求队列合并成一个磁盘请求。
+// 缓存块在读的过程中保持锁定，bread() 会等到 bdone() 放开它。
+// ahead 非0 表示这是投机的预读，计入预读统计。
+void
+bprefetch(uint dev, uint blockno, int n, int ahead)
+{
+  struct buf *b;
+  struct blkplug plug;
+
+  blk_plug(&plug);
+  for(int i = 0; i < n; i++){
+    if((b = bget(dev, blockno + i, 1, 0)) == 0)
+      continue;
+    if(ahead){
+      b->ra = 1;
+      __sync_fetch_and_add(&rastat.issued, 1);
+    }
+    blk_submit(b, 0, 1);
   }
+  blk_unplug(&plug);
+}
 
-  if (!take_buf) 
-    panic("bget: no buffers");
+// 异步请求完成：数据有效了，放开缓存块并释放引用。
+// 由 virtio_disk_intr() 调用，不能睡眠。
+void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
 
-  // 通过将上一个引用计数为零的缓冲区块的 next 指针指向 take_buf 的下一个缓冲区块，实现了从链表中移除 take_buf。
-  last_take->next = take_buf->next; 
-  // 将 take_buf 的 next 指针置为0，确保 take_buf 不再与原哈希桶中的其他缓冲区块相连接
-  take_buf->next = 0;
-  release(&bcache.lock[lock_num]);
+  struct bucket *bk = lockbuf(b);
+  b->refcnt--;
+  if(b->refcnt == 0)
+    lru_append(bk, b);
+  release(&bk->lock);
+}
 
-  last_b->next = take_buf; // 将从其他桶拿来的 take_buf 插入到初始的哈希桶中
-  take_buf->next = 0;
-  write_cache(take_buf, dev, blockno); // 对缓存块进行初始化，写入磁盘
+static struct buf* bstart(uint, uint, int);
+static void bwaitx(struct buf*, int);
 
-  release(&bcache.lock[id]); // 释放当前哈希桶的锁
-  acquiresleep(&take_buf->lock); // 获取缓存块的锁
+// 返回一个锁定的缓冲区（struct buf），该缓冲区包含指定块的内容。
+struct buf*
+bread(uint dev, uint blockno)
+{
+  return breadx(dev, blockno, 0);
+}
 
-  return take_buf; // 返回找到的缓存块 
+// 带标志的 bread()。BREAD_STREAM：顺序扫过的数据块，用完就可以替换。
+// BREAD_SHARED：见 bread_shared()。BREAD_POLL：轮询等待读完。
+struct buf*
+breadx(uint dev, uint blockno, int flags)
+{
+  struct buf *b;
+
+  b = bstart(dev, blockno, flags);
+  if(!(flags & BREAD_SHARED))
+    bwaitx(b, flags);
+  return b;
 }
 
-// 返回一个锁定的缓冲区（struct buf），该缓冲区包含指定块的内容。
+// 只读地读一个块：多个读者可以同时持有同一个块，
+// 写者（bread()）要等它们都 brelse()。不能对返回的块调用 bwrite() 或 log_write()。
 struct buf*
-bread(uint dev, uint blockno)
+bread_shared(uint dev, uint blockno)
+{
+  return breadx(dev, blockno, BREAD_SHARED);
+}
+
+// 和 bread() 一样返回锁定的缓冲区，但如果要读盘，只发出请求不等待。
+// 调用者在使用 b->data 之前必须先 bwait(b)；
+// 这样可以先把一批块的请求都发出去，再一起等待。
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  return bstart(dev, blockno, 0);
+}
+
+// 读到一个块时的统计和 2Q 记录。
+static void
+baccount(struct buf *b, int flags)
+{
+  if(b->ra){
+    b->ra = 0;
+    __sync_fetch_and_add(&rastat.hit, 1);
+  }
+  // 第二次被读到的块升到 am；流式读不算
+  b->stream = (flags & BREAD_STREAM) != 0;
+  if(b->used && !b->stream)
+    b->hot = 1;
+  b->used = 1;
+  if(!b->valid)
+    __sync_fetch_and_add(&rastat.miss, 1);
+}
+
+// bread 系列的公共部分：找到或分配缓存块，记一次引用，需要时发出读请求。
+static struct buf*
+bstart(uint dev, uint blockno, int flags)
 {
   struct buf *b;
 
   // 获取具有指定设备和块号的缓冲区（如果缓冲区不在内存中，则将其读取到内存中）
-  b = bget(dev, blockno);
-  // 如果缓冲区的内容无效（还没有填充上对应的磁盘的数据），则通过 virtio_disk_rw 函数将其内容从磁盘读取到缓冲区中
-  if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+  b = bget(dev, blockno, 0, flags & BREAD_SHARED);
+  baccount(b, flags);
+  // 如果缓冲区的内容无效（还没有填充上对应的磁盘的数据），则发出读请求
+  if(!b->valid)
+    blk_submit(b, 0, 0);
+  // 要共享锁却独占地拿到了（块还没读进来）：读完之后降级
+  if((flags & BREAD_SHARED) && holdingsleep(&b->lock)){
+    bwaitx(b, flags);
+    downgradesleep(&b->lock);
   }
   return b;
 }
 
+// 一次拿到块号从 blockno 开始连续的 n 个块，放在 bs[] 中，都独占地锁住；
+// 不在缓存中的块合并成尽量少的磁盘请求。和 bread_async() 一样，
+// 使用每一块之前先 bwait()。
+void
+breadv_async(uint dev, uint blockno, int n, struct buf **bs)
+{
+  struct blkplug plug;
+
+  blk_plug(&plug);
+  for(int i = 0; i < n; i++){
+    bs[i] = bget(dev, blockno + i, 0, 0);
+    baccount(bs[i], 0);
+    if(!bs[i]->valid)
+      blk_submit(bs[i], 0, 0);
+  }
+  blk_unplug(&plug);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
+{
+  bwrite_async(b);
+  bwait(b);
+}
+
+// 发出 b 的写请求，不等待。必须持有 b 的锁，
+// 并且在 brelse(b) 或修改 b->data 之前 bwait(b)。
+void
+bwrite_async(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  blk_submit(b, 1, 0);
+}
+
+// 对 bs[0..n) 发出写请求，块号连续的合并成一个磁盘请求，不等待。
+// 要求和 bwrite_async() 一样，之后对每一块 bwait()。
+void
+bwritev_async(struct buf **bs, int n)
+{
+  struct blkplug plug;
+
+  blk_plug(&plug);
+  for(int i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwrite");
+    blk_submit(bs[i], 1, 0);
+  }
+  blk_unplug(&plug);
+}
+
+// 等待 bread_async()/bwrite_async() 发出的请求完成。
+// 读完之后 b->data 就有效了；没有请求在进行时直接返回。
+void
+bwait(struct buf *b)
+{
+  bwaitx(b, 0);
+}
+
+// 带 breadx() 标志的 bwait()，BREAD_POLL 时轮询等待。
+static void
+bwaitx(struct buf *b, int flags)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  blk_wait(b, (flags & BREAD_POLL) != 0);
+  b->valid = 1;
 }
 
 // Release a locked buffer.
@@ -259,19 +828,21 @@ bwrite(struct buf *b)
 //   release(&bcache.lock);
 // }
 
-//获取锁，然后将块引用计数-1
+//获取锁，然后将块引用计数-1；减到0时放到桶的 lru 链表尾部
 void
 brelse(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("brelse");
+  // 不是独占地持有，就是 bread_shared() 得到的
+  if(holdingsleep(&b->lock))
+    releasesleep(&b->lock);
+  else
+    releasesleep_shared(&b->lock);
 
-  releasesleep(&b->lock);
-
-  int id = hash(b->blockno);
-  acquire(&bcache.lock[id]);
+  struct bucket *bk = lockbuf(b);
   b->refcnt--;  
-  release(&bcache.lock[id]);
+  if(b->refcnt == 0)
+    lru_append(bk, b);
+  release(&bk->lock);
 }
 
 // void
@@ -284,10 +855,9 @@ brelse(struct buf *b)
 // 获取锁，引用计数+1
 void
 bpin(struct buf *b) {
-  int id = hash(b->blockno);
-  acquire(&(bcache.lock[id]));
+  struct bucket *bk = lockbuf(b);
   b->refcnt++;
-  release(&(bcache.lock[id]));
+  release(&bk->lock);
 }
 
 // void
@@ -301,8 +871,66 @@ bpin(struct buf *b) {
 // unpin：一个术语，表示取消引用或释放一个之前由某个操作引用的资源
 void
 bunpin(struct buf *b) {
-  int id = hash(b->blockno);
-  acquire(&(bcache.lock[id]));
+  struct bucket *bk = lockbuf(b);
   b->refcnt--;
-  release(&(bcache.lock[id]));
-}
\ No newline at end of file
+  if(b->refcnt == 0)
+    lru_append(bk, b);
+  release(&bk->lock);
+}
+
+// 输出预读和替换统计，供 statistics 和 bcachestat 设备使用
+int
+bcachestats(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- bcache readahead: issued %d hit %d miss %d wasted %d\n",
+               rastat.issued, rastat.hit, rastat.miss, rastat.wasted);
+  n += snprintf(buf+n, sz-n, "--- bcache evict: a1 %d am %d stream %d\n",
+                evstat.a1, evstat.am, evstat.stream);
+  return n;
+}
+
+// 输出每个桶的统计，供 bcachestat 设备使用：
+// 块数、空闲块数、正在使用的块数、被日志 pin 住的脏块数（当前值），
+// 以及命中、未命中、偷来、替换、bget() 次数、总耗时和平均耗时（累计值）。
+// 时间的单位是 time 计数器的周期。
+// 最后一行是散列链长度的分布：有 0、1、…、NCHAIN-2 块的桶数，
+// 最后一项是 NCHAIN-1 块及以上的桶数。
+#define NCHAIN 16
+int
+bcachestat(char *buf, int sz)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int n, nb, busy, dirty, nbucket;
+  int hist[NCHAIN];
+
+  memset(hist, 0, sizeof(hist));
+  nbucket = bcache.nbucket;
+  n = snprintf(buf, sz, "bucket bufs free busy dirty hit miss steal evict gets time avg\n");
+  for(int id = 0; id < nbucket; id++){
+    bk = &bcache.bucket[id];
+    nb = busy = dirty = 0;
+    acquire(&bk->lock);
+    for(b = bk->chain; b; b = b->next){
+      nb++;
+      if(b->refcnt > 0)
+        busy++;
+      if(b->dirty)
+        dirty++;
+    }
+    n += snprintf(buf+n, sz-n, "%d %d %d %d %d %d %d %d %d %d %lu %d\n",
+                  id, nb, bk->nfree, busy, dirty,
+                  bk->hit, bk->miss, bk->steal, bk->evict,
+                  bk->nget, bk->time,
+                  bk->nget ? (int)(bk->time / bk->nget) : 0);
+    release(&bk->lock);
+    hist[nb < NCHAIN ? nb : NCHAIN-1]++;
+  }
+  n += snprintf(buf+n, sz-n, "chains:");
+  for(int i = 0; i < NCHAIN; i++)
+    n += snprintf(buf+n, sz-n, " %d", hist[i]);
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
@@ -0,0 +1,481 @@
+// 块设备请求队列，在 bio.c 和 virtio_disk.c 之间。
+//
+// bio.c 用 blk_submit() 提交单个缓存块的读写请求。请求先在队列里排队，
+// 和块号相邻的请求合并成一个多段请求（最多 NCLUSTER 块，经 b->cnext 串起来），
+// 再由调度策略决定发给设备的顺序。每个请求队列对应一个 virtio 队列，
+// 设备支持多队列时每个 hart 一个（见 virtio_disk.c），请求放进提交它的 hart 的队列，
+// 各队列有各自的锁。每个队列里最多同时有 BLK_DEPTH 个请求在设备中，
+// 其余的在队列里等，每完成一批（blk_complete()）就再发一些。
+//
+// 调度策略（可以在运行时切换，见 blk_setpolicy()）：
+//   noop     ：按到达顺序发出，只做合并
+//   deadline ：单向电梯，从上一个请求结束的块号往上找最近的请求，到头了绕回最小的；
+//              排队超过期限的请求优先（读 BLK_READEXP，写 BLK_WRITEEXP 个 tick）
+//
+// 进程可以用 blk_plug()/blk_unplug() 把一批请求先攒在自己的 plug 里，
+// 按块号排好序之后一起放进队列，这样连续的块一定能合并。
+// blk_wait() 等待之前会先把 plug 里的请求放进队列；进程在 sleep() 和 yield()
+// 中放弃 cpu 之前也会（拿 p->lock 之前，见 blk_flush()），否则别的进程等着
+// 它攒下的块、它又在等别的进程时就会死锁。不能放到 sched() 里：那时持有 p->lock，
+// 而 virtio_disk_reap() 是拿着 vq->lock 去 wakeup() 的。
+//
+// 每个请求记下提交、交给设备和完成的时间（time 计数器）。完成时 blk_account()
+// 按读写和块的类别（日志、元数据、数据）记入 log2 的延迟分布，
+// 并记到本 cpu 最近请求的环形缓冲里。iostat 设备输出这些内容。
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+
+extern struct superblock sb;  // fs.c
+
+#define BLK_DEPTH 32     // 每个队列在设备里同时进行的请求数上限
+#define BLK_PLUGMAX 32   // plug 里攒到这么多块就先放进队列
+#define BLK_READEXP 1    // deadline：读请求最多排队的 tick 数
+#define BLK_WRITEEXP 5   // deadline：写请求最多排队的 tick 数
+#define NHIST 32         // 延迟分布的桶数，第 i 个桶是 [2^i, 2^(i+1)) 个 time 周期
+#define NTRACE 64        // 每个 cpu 记下的最近请求数
+
+// 块的类别
+#define IO_LOG  0        // 日志区
+#define IO_META 1        // 引导块、超级块、inode 和位图
+#define IO_DATA 2        // 数据区（包括目录和间接块）
+#define NCLASS  3
+
+struct blkq {
+  struct spinlock lock;
+  struct buf *head;     // 排队的请求（每个是一串块的第一块），经 qnext 按到达顺序相连
+  int nq;               // 排队的请求数
+  int inflight;         // 已经交给设备、还没完成的请求数
+  uint64 pos;           // 电梯的位置：上一个发出的请求之后的 (dev, blockno)
+
+  // 统计
+  uint nbuf;            // 提交的块数
+  uint nreq;            // 发给设备的请求数
+  uint nmerge;          // 合并进已有请求的块数
+  uint64 qsum;          // 每块进队列时队列中（排队加进行中）的请求数之和
+  int qmax;             // 其最大值
+};
+
+struct blkpolicy {
+  char *name;
+  // 从非空的队列 q 中选出下一个要发出的请求（不摘下）。调用者持有 q->lock。
+  struct buf *(*pick)(struct blkq*);
+};
+
+static struct blkq blkq[NCPU];
+static int nblkq;       // 用到的队列数，和 virtio 队列一样多
+static struct blkpolicy *policy;
+
+// 每种请求（读/写 x 类别）的延迟分布，从提交到完成。用原子加更新。
+static struct {
+  uint count;
+  uint64 total;
+  uint bucket[NHIST];
+} hist[2][NCLASS];
+
+// 一个完成的请求
+struct iotrace {
+  uint64 tsubmit;  // 提交的时间
+  uint blockno;    // 第一块的块号
+  ushort n;        // 块数
+  uchar write;
+  uchar class;
+  uint queue;      // 排队时间：提交到交给设备
+  uint device;     // 设备时间：交给设备到完成
+};
+
+// 每个 cpu 最近完成的 NTRACE 个请求，由完成它们的 cpu 记下
+static struct {
+  struct spinlock lock;
+  struct iotrace ent[NTRACE];
+  uint next;       // 下一个要写的位置（一直增长，用时取模）
+} trace[NCPU];
+
+static char *classname[NCLASS] = { "log", "meta", "data" };
+
+// 请求在电梯上的位置
+static uint64
+key(struct buf *b)
+{
+  return ((uint64)b->dev << 32) | b->blockno;
+}
+
+static struct buf*
+noop_pick(struct blkq *q)
+{
+  return q->head;
+}
+
+static struct buf*
+deadline_pick(struct blkq *q)
+{
+  struct buf *r, *old = 0, *up = 0, *low = 0;
+
+  for(r = q->head; r; r = r->qnext){
+    if(old == 0 && ticks - r->qtime >= (r->write ? BLK_WRITEEXP : BLK_READEXP))
+      old = r;  // 队列按到达顺序，第一个过期的就是等得最久的
+    if(key(r) >= q->pos && (up == 0 || key(r) < key(up)))
+      up = r;
+    if(low == 0 || key(r) < key(low))
+      low = r;
+  }
+  if(old)
+    return old;
+  return up ? up : low;
+}
+
+static struct blkpolicy policies[] = {
+  { "noop", noop_pick },
+  { "deadline", deadline_pick },
+};
+
+// 在 virtio_disk_init() 之后调用。
+void
+blkinit(void)
+{
+  nblkq = virtio_disk_nqueue();
+  for(int i = 0; i < nblkq; i++)
+    initlock(&blkq[i].lock, "blkq");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&trace[i].lock, "iotrace");
+  policy = &policies[1];
+}
+
+// 本 hart 提交请求用的队列
+static struct blkq*
+myqueue(void)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  return &blkq[id % nblkq];
+}
+
+// 按名字选择调度策略，成功返回0，没有这个策略返回 -1。
+// 已经在排队的请求按新的策略发出。
+int
+blk_setpolicy(char *name)
+{
+  for(int i = 0; i < NELEM(policies); i++){
+    if(strncmp(name, policies[i].name, 16) == 0){
+      policy = &policies[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// 把一块的请求 b 放进队列 q：能接在某个同方向的请求后面或前面就合并进去，
+// 否则排到队尾。调用者持有 q->lock。
+static void
+enqueue(struct blkq *q, struct buf *b)
+{
+  struct buf **pp, *r, *t;
+  int n;
+
+  b->hwq = q - blkq;
+  q->nbuf++;
+  q->qsum += q->nq + q->inflight;
+  if(q->nq + q->inflight > q->qmax)
+    q->qmax = q->nq + q->inflight;
+
+  for(pp = &q->head; (r = *pp) != 0; pp = &r->qnext){
+    if(r->dev != b->dev || r->write != b->write)
+      continue;
+    for(t = r, n = 1; t->cnext; t = t->cnext)
+      n++;
+    if(n >= NCLUSTER)
+      continue;
+    if(t->blockno + 1 == b->blockno){
+      t->cnext = b;
+      q->nmerge++;
+      return;
+    }
+    if(b->blockno + 1 == r->blockno){
+      // b 成为这串的第一块，继承原来的排队时间
+      b->cnext = r;
+      b->qnext = r->qnext;
+      b->qtime = r->qtime;
+      b->tsubmit = r->tsubmit;
+      *pp = b;
+      q->nmerge++;
+      return;
+    }
+  }
+  b->qnext = 0;
+  *pp = b;
+  q->nq++;
+}
+
+// 在设备允许的范围内按调度策略发出 q 中排队的请求。
+// 可能在中断中被调用，不能睡眠。调用者持有 q->lock。
+static void
+blk_run(struct blkq *q)
+{
+  struct buf *r, *t, **pp;
+
+  while(q->head && q->inflight < BLK_DEPTH){
+    r = policy->pick(q);
+    // 设备完成请求时会清掉 cnext，所以先摘下、记下位置再发
+    for(pp = &q->head; *pp != r; pp = &(*pp)->qnext)
+      ;
+    *pp = r->qnext;
+    for(t = r; t->cnext; t = t->cnext)
+      ;
+    if(virtio_disk_start(r, r->write) < 0){
+      // 描述符用完了（不支持间接描述符时），等有请求完成再发
+      // 放回原来的位置，不打乱到达顺序
+      r->qnext = *pp;
+      *pp = r;
+      break;
+    }
+    q->pos = key(t) + 1;
+    q->nq--;
+    r->tdispatch = r_time();
+    q->inflight++;
+    q->nreq++;
+  }
+}
+
+// 把本进程 plug 里的请求按块号排好序放进本 hart 的队列并发出。
+// sleep() 和 yield() 在拿 p->lock 之前也调用它；yield() 可能是时钟中断
+// 打断了 blk_submit() 或者这里，所以摘下 plug 的链表时关中断。
+void
+blk_flush(void)
+{
+  struct proc *p = myproc();
+  struct blkplug *pl;
+  struct blkq *q;
+  struct buf *b, *list, *sorted = 0, **pp;
+
+  if(p == 0 || (pl = p->plug) == 0)
+    return;
+  push_off();
+  list = pl->list;
+  pl->list = 0;
+  pl->n = 0;
+  pop_off();
+  if(list == 0)
+    return;
+  // 插入排序，块数不多
+  while((b = list) != 0){
+    list = b->qnext;
+    for(pp = &sorted; *pp && key(*pp) < key(b); pp = &(*pp)->qnext)
+      ;
+    b->qnext = *pp;
+    *pp = b;
+  }
+
+  q = myqueue();
+  acquire(&q->lock);
+  while((b = sorted) != 0){
+    sorted = b->qnext;
+    enqueue(q, b);
+  }
+  blk_run(q);
+  release(&q->lock);
+}
+
+// 开始攒请求。可以嵌套，由最外层的 blk_unplug() 放进队列。
+void
+blk_plug(struct blkplug *pl)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->plug != 0)
+    return;
+  pl->list = 0;
+  pl->n = 0;
+  p->plug = pl;
+}
+
+// 结束攒请求，把攒下的放进队列。
+void
+blk_unplug(struct blkplug *pl)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->plug != pl)
+    return;
+  blk_flush();
+  p->plug = 0;
+}
+
+// 提交 b 的读（write 为0）或写请求，不等待。async 非0 时请求完成后
+// 由 bdone() 放开缓存块，否则调用者之后用 blk_wait() 等待。
+// 调用者持有 b 的锁，完成之前不能动 b->data。
+void
+blk_submit(struct buf *b, int write, int async)
+{
+  struct proc *p = myproc();
+  struct blkq *q;
+
+  b->disk = 1;  // 从现在起直到请求完成，blk_wait() 都要等
+  b->async = async;
+  b->write = write;
+  b->cnext = 0;
+  b->qtime = ticks;
+  b->tsubmit = r_time();
+
+  if(p && p->plug){
+    int full;
+    push_off();  // 见 blk_flush()
+    b->qnext = p->plug->list;
+    p->plug->list = b;
+    full = ++p->plug->n >= BLK_PLUGMAX;
+    pop_off();
+    if(full)
+      blk_flush();
+    return;
+  }
+
+  q = myqueue();
+  acquire(&q->lock);
+  enqueue(q, b);
+  blk_run(q);
+  release(&q->lock);
+}
+
+// 等待 blk_submit() 提交的同步请求完成；没有请求在进行时直接返回。
+// poll 非0 时先轮询一段时间再睡眠，见 virtio_disk_wait()。
+void
+blk_wait(struct buf *b, int poll)
+{
+  blk_flush();
+  virtio_disk_wait(b, poll);
+}
+
+// 设备在队列 hwq 上完成了 n 个请求，由 virtio_disk_intr() 调用。
+void
+blk_complete(int hwq, int n)
+{
+  struct blkq *q = &blkq[hwq];
+
+  acquire(&q->lock);
+  q->inflight -= n;
+  blk_run(q);
+  release(&q->lock);
+}
+
+// 块的类别，按文件系统的布局：引导块 | 超级块 | 日志 | inode | 位图 | 数据。
+static int
+ioclass(uint blockno)
+{
+  if(sb.size == 0)
+    return IO_META;  // 还没读到超级块
+  if(blockno >= sb.logstart && blockno < sb.logstart + sb.nlog)
+    return IO_LOG;
+  if(blockno < sb.bmapstart + sb.size/BPB + 1)
+    return IO_META;
+  return IO_DATA;
+}
+
+// 以 b 开头的请求完成了，记入延迟分布和本 cpu 的环形缓冲。
+// 由 virtio_disk_reap() 在放开缓存块之前调用，不能睡眠。
+void
+blk_account(struct buf *b)
+{
+  uint64 now = r_time();
+  uint64 lat = now - b->tsubmit;
+  struct buf *t;
+  struct iotrace *e;
+  int n, i, c, w;
+
+  for(t = b, n = 0; t; t = t->cnext)
+    n++;
+  c = ioclass(b->blockno);
+  w = b->write != 0;
+  for(i = 0; i < NHIST-1 && (lat >> (i+1)) != 0; i++)
+    ;
+  __sync_fetch_and_add(&hist[w][c].count, 1);
+  __sync_fetch_and_add(&hist[w][c].total, lat);
+  __sync_fetch_and_add(&hist[w][c].bucket[i], 1);
+
+  push_off();
+  int id = cpuid();
+  acquire(&trace[id].lock);
+  e = &trace[id].ent[trace[id].next++ % NTRACE];
+  e->tsubmit = b->tsubmit;
+  e->blockno = b->blockno;
+  e->n = n;
+  e->write = w;
+  e->class = c;
+  e->queue = b->tdispatch - b->tsubmit;
+  e->device = now - b->tdispatch;
+  release(&trace[id].lock);
+  pop_off();
+}
+
+// 输出延迟分布和最近的请求，供 iostat 设备使用。时间都是 time 计数器的周期。
+// 每种请求一行：
+//   hist 读写 类别 个数 平均延迟 NHIST 个桶的计数
+// 每个记下的请求一行（每个 cpu 从旧到新）：
+//   trace cpu 提交时间（毫秒） 块号 块数 读写 类别 排队时间 设备时间
+int
+iostat(char *buf, int sz)
+{
+  int n = 0;
+
+  for(int w = 0; w < 2; w++){
+    for(int c = 0; c < NCLASS; c++){
+      n += snprintf(buf+n, sz-n, "hist %s %s %d %d", w ? "write" : "read", classname[c],
+                    hist[w][c].count,
+                    hist[w][c].count ? (int)(hist[w][c].total / hist[w][c].count) : 0);
+      for(int i = 0; i < NHIST; i++)
+        n += snprintf(buf+n, sz-n, " %d", hist[w][c].bucket[i]);
+      n += snprintf(buf+n, sz-n, "\n");
+    }
+  }
+  for(int id = 0; id < NCPU; id++){
+    acquire(&trace[id].lock);
+    uint i = trace[id].next > NTRACE ? trace[id].next - NTRACE : 0;
+    for(; i < trace[id].next; i++){
+      struct iotrace *e = &trace[id].ent[i % NTRACE];
+      n += snprintf(buf+n, sz-n, "trace %d %d %d %d %s %s %d %d\n",
+                    id, (int)(e->tsubmit / 10000), e->blockno, e->n,
+                    e->write ? "write" : "read", classname[e->class],
+                    e->queue, e->device);
+    }
+    release(&trace[id].lock);
+  }
+  return n;
+}
+
+// 输出请求队列的统计（所有队列合计），接在 bcachestat 设备的后面：调度策略，
+// 队列数，提交的块数、发出的请求数、合并的块数、每个请求的平均块数（乘以100），
+// 块进队列时队列中的平均和最大请求数，以及当前排队和进行中的请求数。
+int
+blkstat(char *buf, int sz)
+{
+  struct blkq *q;
+  uint nbuf = 0, nreq = 0, nmerge = 0;
+  uint64 qsum = 0;
+  int qmax = 0, nq = 0, inflight = 0;
+
+  for(q = blkq; q < blkq + nblkq; q++){
+    acquire(&q->lock);
+    nbuf += q->nbuf;
+    nreq += q->nreq;
+    nmerge += q->nmerge;
+    qsum += q->qsum;
+    if(q->qmax > qmax)
+      qmax = q->qmax;
+    nq += q->nq;
+    inflight += q->inflight;
+    release(&q->lock);
+  }
+  return snprintf(buf, sz, "blk: %s queues %d bufs %d reqs %d merges %d blocks/req(x100) %d "
+                  "depth avg %d max %d queued %d inflight %d\n",
+                  policy->name, nblkq, nbuf, nreq, nmerge,
+                  nreq ? (int)((uint64)nbuf * 100 / nreq) : 0,
+                  nbuf ? (int)(qsum / nbuf) : 0, qmax, nq, inflight);
+}
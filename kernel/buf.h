@@ -10,6 +10,15 @@
 //   uchar data[BSIZE];
 // };
 
+// breadx() 的标志
+#define BREAD_STREAM 0x1  // 顺序扫过的数据块，用完就可以替换
+#define BREAD_SHARED 0x2  // 只读，以共享方式锁住缓存块，多个读者可以同时持有
+#define BREAD_POLL   0x4  // 要读盘时轮询等待完成，而不是睡眠等中断（小的、延迟敏感的读）
+
+// 一个磁盘请求最多包含的块数（块号连续）。每个请求用一张 NCLUSTER+2 项的
+// virtio 间接描述符表；设备不支持间接描述符时，队列至少要有 NCLUSTER+2 个描述符。
+#define NCLUSTER 16
+
 struct buf {
   int valid;   // 是否包含磁盘块的有效数据
   int disk;    // does disk "own" buf?
@@ -17,9 +26,30 @@ struct buf {
   uint blockno; // 磁盘块号
   struct sleeplock lock; // 用于同步的睡眠锁
   uint refcnt; // 缓冲区的引用计数
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // 散列桶链表
   struct buf *next; // 用于构建链表的指针
+  int bucket;  // 所在的散列桶（bio.c），桶数翻倍时会变
+  // 引用计数为0时挂在所在桶的 lru 链表上，寻找空闲块时，直接取最久未被使用的那个。
+  struct buf *lprev;
+  struct buf *lnext;
+  struct buf *cnext; // 同一个磁盘请求中的下一块（块号连续），请求完成后清零
+  int async;   // 异步请求：完成时由 virtio_disk_intr() 调用 bdone()
+  int polling; // 等待者正在轮询，完成时不用 wakeup()
+  struct buf *qnext; // 请求队列或 plug 中的下一个请求（blk.c）
+  int write;   // 排队的请求是写
+  int hwq;     // 请求所在的队列（blk.c 和 virtio 队列的下标）
+  uint qtime;  // 请求进入队列的时间（ticks）
+  uint64 tsubmit;   // 提交请求的时间（time 计数器），合并后是这串里最早的
+  uint64 tdispatch; // 交给设备的时间，只记在一串的第一块上
+  int ra;      // 由预读装入，还没有被 bread() 用过
+  int dirty;   // 已经提交到日志，还没写回原位置（此时一直被 pin 住）
+  int used;    // 装入后被 bread() 读过
+  int hot;     // 被再次读到过，空闲时在 am 链表上
+  int stream;  // 最近一次是流式读（BREAD_STREAM），空闲时最先替换
   uchar data[BSIZE];
-  // 为cache块打上时间戳，每次使用时更新，寻找空闲块时，优先选择最久未被使用的空闲块。
-  uint time; // 最后一次被使用的时间
-};
\ No newline at end of file
+};
+// 一个进程攒着还没放进请求队列的请求，见 blk_plug()
+struct blkplug {
+  struct buf *list;  // 经 qnext 相连
+  int n;
+};
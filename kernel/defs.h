@@ -4,6 +4,7 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -17,11 +18,36 @@ struct sock;
 
 // bio.c
 void            binit(void);
+void            bprefetch(uint, uint, int, int);
+void            bdone(struct buf*);
 struct buf*     bread(uint, uint);
+struct buf*     breadx(uint, uint, int);
+struct buf*     bread_shared(uint, uint);
+struct buf*     bread_async(uint, uint);
+void            breadv_async(uint, uint, int, struct buf**);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
+int             bsetlimit(int, int);
+
+// blk.c
+struct blkplug;
+void            blkinit(void);
+int             blk_setpolicy(char*);
+void            blk_plug(struct blkplug*);
+void            blk_unplug(struct blkplug*);
+void            blk_flush(void);
+void            blk_submit(struct buf*, int, int);
+void            blk_wait(struct buf*, int);
+void            blk_complete(int, int);
+int             blkstat(char*, int);
+void            blk_account(struct buf*);
+int             iostat(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -47,6 +73,7 @@ struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
+int             ishrink(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -69,14 +96,26 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void*           kalloc_zeroed(void);
+void            kaddref(void *);
+void            kfree_batch(void **, int);
+void            ksplit(void *, int);
+int             krefcnt(void *);
+void            kzero_refill(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_tick(void);
+int             logsetflush(int, int);
+int             logstat(char*, int);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -110,10 +149,17 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             kthread_create(void (*)(void*), void*, char*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            kmem_cache_drain(struct kmem_cache*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -130,6 +176,9 @@ void            freelock(struct spinlock*);
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleep_shared(struct sleeplock*);
+void            releasesleep_shared(struct sleeplock*);
+void            downgradesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
@@ -156,6 +205,14 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+int             lazyalloc(pagetable_t, uint64);
+
+// tlb.c
+void            tlbinit(void);
+uint64          tlb_activate(struct proc*);
+void            tlb_flush_page(pagetable_t, uint64);
+void            tlb_flush(pagetable_t);
+void            tlb_flush_range(pagetable_t, uint64, uint64);
 
 // uart.c
 void            uartinit(void);
@@ -173,9 +230,11 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
+int             uvmallocsuper(pagetable_t, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             cowfault(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
@@ -191,8 +250,11 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_nqueue(void);
+int             virtio_disk_start(struct buf *, int);
+void            virtio_disk_wait(struct buf *, int);
 void            virtio_disk_intr(void);
+int             virtio_disk_stat(char*, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
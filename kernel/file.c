@@ -12,17 +12,22 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+// struct file 从 slab 按需分配，不再扫描固定数组；
+// 仍然用 nfile 把打开文件总数限制在 NFILE 以内。
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache cache;
+  int nfile;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -32,15 +37,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.nfile >= NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmem_cache_alloc(&ftable.cache)) == 0){
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -71,7 +83,9 @@ fileclose(struct file *f)
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -38,6 +38,13 @@ struct inode {
   // 存储文件数据块的数组。前NDIRECT个元素存储直接块的地址，最后一个元素存储间接块的地址。
   // 每个块的大小为BSIZE（磁盘块大小）。
   uint addrs[NDIRECT+1];
+  struct inode *next; // itable 散列链，由 itable.lock 保护
+  struct inode *lprev; // ref 为0 时在 itable 的 LRU 链上，由 itable.lock 保护
+  struct inode *lnext;
+  // 顺序读检测与预读（readi），由 lock 保护
+  uint ra_next; // 上次 readi 读到的块之后的那一块；下次从这里读就是顺序读
+  uint ra_win;  // 当前预读窗口（块数），非顺序读时为0
+  uint ra_end;  // 已经发出预读的块到这里为止
 };
 
 // map major device number to device functions.
@@ -50,3 +57,5 @@ extern struct devsw devsw[];
 
 #define CONSOLE 1
 #define STATS   2
+#define BCACHESTAT 3
+#define IOSTAT  4
@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -106,26 +107,130 @@ bfree(int dev, uint b)
 
 // Inodes. 索引节点
 
+// 内存中的 inode 从 slab 按需分配，
+// 按 (dev, inum) 散列到 NIHASH 条链上查找，不再线性扫描固定数组。
+// 引用计数降为0时不马上释放：已经读入的 inode 留在散列链上，
+// 同时放进 LRU 链，下次 iget() 时不用再读盘。这样的 inode 最多 NINODE 个，
+// 多了释放最久没用的；内存紧张时 kalloc() 调用 ishrink() 释放一些。
+#define NIHASH 31
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+#define ISHRINK 16   // ishrink() 一次最多释放的 inode 数
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache cache;
+  struct inode *hash[NIHASH];
+  struct inode *lru;   // 引用计数为0的 inode，双向循环链表，lru 是最近用过的
+  int nlru;
 } itable; // inode表
 
 // 初始化inode表
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    // inode表中的每个inode都有一个相关联的锁，用于同步对inode的访问
-    initsleeplock(&itable.inode[i].lock, "inode"); 
-  }
+  kmem_cache_init(&itable.cache, "inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// 把 ip 从 LRU 链上摘下。调用者持有 itable.lock。
+static void
+lru_remove(struct inode *ip)
+{
+  if(ip->lnext == ip){
+    itable.lru = 0;
+  } else {
+    ip->lprev->lnext = ip->lnext;
+    ip->lnext->lprev = ip->lprev;
+    if(itable.lru == ip)
+      itable.lru = ip->lnext;
+  }
+  itable.nlru--;
+}
+
+// 把 ip 放到 LRU 链的最前面。调用者持有 itable.lock。
+static void
+lru_push(struct inode *ip)
+{
+  if(itable.lru == 0){
+    ip->lprev = ip->lnext = ip;
+  } else {
+    ip->lnext = itable.lru;
+    ip->lprev = itable.lru->lprev;
+    ip->lprev->lnext = ip;
+    itable.lru->lprev = ip;
+  }
+  itable.lru = ip;
+  itable.nlru++;
+}
+
+// 把 ip 从散列链上摘下。调用者持有 itable.lock。
+static void
+ihash_remove(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+}
+
+// 把已经摘下的 inode 还给 slab。
+static void
+ifree(struct inode *ip)
+{
+#ifdef LAB_LOCK
+  freelock(&ip->lock.lk);
+#endif
+  kmem_cache_free(&itable.cache, ip);
+}
+
+// 摘下 LRU 链上最久没用的 n 个 inode，经 next 串起来返回。
+// 调用者持有 itable.lock，之后用 ifree() 释放。
+static struct inode*
+lru_evict(int n)
+{
+  struct inode *ip, *list = 0;
+
+  while(n-- > 0 && itable.lru){
+    ip = itable.lru->lprev;
+    lru_remove(ip);
+    ihash_remove(ip);
+    ip->next = list;
+    list = ip;
+  }
+  return list;
+}
+
+// 内存不够时由 kalloc() 调用，释放一些缓存着的、没有引用的 inode。
+// 返回释放的个数，0 表示没有可以释放的了。
+// 本cpu已经持有的锁不能再拿：正在给 inode 分配 slab 时直接返回。
+int
+ishrink(void)
+{
+  struct inode *ip, *list;
+  int n = 0;
+
+  push_off();
+  if(holding(&itable.cache.lock) || holding(&itable.lock)){
+    pop_off();
+    return 0;
+  }
+  acquire(&itable.lock);
+  list = lru_evict(ISHRINK);
+  release(&itable.lock);
+  while((ip = list) != 0){
+    list = ip->next;
+    ifree(ip);
+    n++;
+  }
+  if(n > 0)
+    kmem_cache_drain(&itable.cache); // 让空出来的 slab 页回到 kalloc
+  pop_off();
+  return n;
+}
+
 // 用于分配一个inode（索引节点）
 // 通过给它指定类型 type 将其标记为已分配。
 // 返回一个未锁定但已分配并引用的 inode。
@@ -180,31 +285,42 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *new = 0;
+  uint h = IHASH(dev, inum);
 
   acquire(&itable.lock);
 
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  for(;;){
+    // Is the inode already in the table?
+    for(ip = itable.hash[h]; ip; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        if(ip->ref++ == 0)
+          lru_remove(ip);
+        release(&itable.lock);
+        if(new)
+          ifree(new);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    if(new)
+      break;
+    // Allocate a new inode entry.
+    // 分配时可能经 kalloc() 调用 ishrink()，不能拿着 itable.lock；
+    // 放开锁期间别人可能已经加进了同一个 inode，所以分配之后再找一遍。
+    release(&itable.lock);
+    if((new = kmem_cache_alloc(&itable.cache)) == 0)
+      panic("iget: no inodes");
+    initsleeplock(&new->lock, "inode");
+    acquire(&itable.lock);
   }
-
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = new;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ra_next = ip->ra_win = ip->ra_end = 0;
+  ip->next = itable.hash[h];
+  itable.hash[h] = ip;
   release(&itable.lock);
 
   return ip;
@@ -235,7 +351,8 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    // 打开文件、查目录时都在等这一块，轮询等待省掉中断和唤醒的延迟
+    bp = breadx(ip->dev, IBLOCK(ip->inum, sb), BREAD_SHARED|BREAD_POLL);
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
@@ -261,8 +378,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode stays cached on
+// the LRU list (or is freed if it was never read in).
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -291,7 +408,22 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    struct inode *old;
+    if(ip->valid){
+      // 留着，超过 NINODE 个时释放最久没用的
+      lru_push(ip);
+      old = itable.nlru > NINODE ? lru_evict(1) : 0;
+    } else {
+      ihash_remove(ip);
+      old = ip;
+      ip->next = 0;
+    }
+    release(&itable.lock);
+    if(old)
+      ifree(old);
+    return;
+  }
   release(&itable.lock);
 }
 
@@ -329,12 +461,19 @@ bmap(struct inode *ip, uint bn)
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
       ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
+    // 块已经分配的话只读，用共享锁；要分配时再独占地读一次
+    bp = breadx(ip->dev, addr, BREAD_SHARED|BREAD_POLL);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+    if(a[bn] == 0){
+      brelse(bp);
+      bp = bread(ip->dev, addr);
+      a = (uint*)bp->data;
+      if(a[bn] == 0){
+        a[bn] = balloc(ip->dev);
+        log_write(bp);
+      }
     }
+    addr = a[bn];
     brelse(bp);
     return addr;
   }
@@ -348,9 +487,13 @@ void
 itrunc(struct inode *ip)
 {
   int i, j;
-  struct buf *bp;
+  struct buf *bp = 0;
   uint *a;
 
+  // 间接块的读请求先发出去，释放直接块的同时等它读完
+  if(ip->addrs[NDIRECT])
+    bp = bread_async(ip->dev, ip->addrs[NDIRECT]);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -359,7 +502,7 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    bwait(bp);
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
@@ -386,6 +529,70 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// 预读窗口的初始值和上限（块数）
+#define RA_MIN 2
+#define RA_MAX 16
+
+// 对文件的 [bn, end) 块发出预读，磁盘上连续的块合并成一个请求。
+static void
+prefetch(struct inode *ip, uint bn, uint end, int ahead)
+{
+  uint addr, start = 0, len = 0;
+
+  for(; bn < end; bn++){
+    addr = bmap(ip, bn);
+    if(len > 0 && addr == start + len){
+      len++;
+      continue;
+    }
+    if(len > 0)
+      bprefetch(ip->dev, start, len, ahead);
+    start = addr;
+    len = 1;
+  }
+  if(len > 0)
+    bprefetch(ip->dev, start, len, ahead);
+}
+
+// 顺序读检测：这次读的起点正好接着上次读的终点（或者从上次的最后一块接着读），
+// 就认为是顺序读，预读窗口翻倍（至多 RA_MAX 块）；否则窗口清零。
+// readi() 将要读 [first, end) 这些块：把它们和窗口内后面的块一起
+// 异步发出去，readi() 随后的 bread() 只需要等待，磁盘可以同时处理多个请求。
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint first, uint end)
+{
+  uint nblk = (ip->size + BSIZE - 1) / BSIZE; // 文件占用的块数
+  uint stop, bn;
+
+  // 还在上次读的最后一块里（例如 dirlookup 逐项读目录）：不算新的访问
+  if(first + 1 == ip->ra_next && end == ip->ra_next)
+    return;
+
+  if(first == ip->ra_next || first + 1 == ip->ra_next){
+    ip->ra_win = ip->ra_win ? min(ip->ra_win * 2, RA_MAX) : RA_MIN;
+  } else {
+    ip->ra_win = 0;
+    ip->ra_end = 0;
+  }
+  ip->ra_next = end;
+
+  // 只读一块的随机读：直接用 bread()
+  if(ip->ra_win == 0 && end - first <= 1)
+    return;
+
+  // 本次要读的块（一次最多 RA_MAX 块，免得长时间占住太多缓存块）
+  prefetch(ip, first, min(min(end, nblk), first + RA_MAX), 0);
+
+  // 窗口内的后续块，之前已经发出过的不再重复
+  stop = min(end + ip->ra_win, nblk);
+  bn = end > ip->ra_end ? end : ip->ra_end;
+  if(bn < stop)
+    prefetch(ip, bn, stop, 1);
+  if(stop > ip->ra_end)
+    ip->ra_end = stop;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -394,15 +601,23 @@ int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
+  int flags;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
-
+  if(n > 0)
+    readahead(ip, off/BSIZE, (off + n + BSIZE - 1)/BSIZE);
+
+  // 顺序读普通文件时，数据块标记为流式读，不挤掉 inode、位图和目录块
+  // 只读，用共享锁，多个进程可以同时读同一个块
+  flags = BREAD_SHARED;
+  if(ip->type == T_FILE && ip->ra_win > 0)
+    flags |= BREAD_STREAM;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = breadx(ip->dev, bmap(ip, off/BSIZE), flags);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -424,7 +639,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, end;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -432,6 +647,11 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  // 跨多块的写：先把已有的块一起读进来，磁盘上连续的合并成一个请求
+  end = min((off + n + BSIZE - 1)/BSIZE, (ip->size + BSIZE - 1)/BSIZE);
+  if(end > off/BSIZE + 1)
+    prefetch(ip, off/BSIZE, min(end, off/BSIZE + RA_MAX), 0);
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
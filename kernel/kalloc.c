@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// 底层是一个伙伴系统（buddy），按 2^order 页的块管理物理内存，
+// 释放时与伙伴块合并；kalloc_pages()/kfree_pages() 直接使用它。
+// kalloc()/kfree() 是 order 0 的快速路径：每个cpu在伙伴系统前面
+// 挂一个单页缓存 kmem[cpu]，批量地从伙伴系统取页、还页。
+//
+// 每个cpu另有一个预先清零的页池，由 scheduler() 空闲时调用
+// kzero_refill() 补充，kalloc_zeroed() 优先从中取页。
+// 每个物理页有一个引用计数 kref[]，供写时复制（COW）的 fork 共享页使用：
+// 分配出去时为1，kaddref() 加1，kfree() 减1，减到0才真正释放。
+//
+// 只有定义了 KALLOCDEBUG（make KALLOCDEBUG=1）时才在分配和释放时
+// 填充垃圾值，用来捕捉悬空引用。
 
 #include "types.h"
 #include "param.h"
@@ -10,12 +23,15 @@
 #include "defs.h"
 
 void freerange(void *pa_start, void *pa_end);
+static void buddy_free(void *pa, int order);
+static int refill(int i, int max);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
 struct run {
   struct run *next;
+  struct run *prev; // 只在伙伴系统的空闲链表中使用
 };
 
 // struct {
@@ -23,12 +39,49 @@ struct run {
 //   struct run *freelist;
 // } kmem;
 
+// 一次窃取最多搬运的页数。每次取对方空闲链表的一半，
+// 但不超过这个值，避免长时间持有对方的锁。
+#define KSTEAL_MAX 64
+
+// 每个cpu缓存与伙伴系统之间一次搬运的页数，
+// 以及cpu缓存的上限：超过上限时把一批页还给伙伴系统，以便合并。
+#define KBATCH 32
+#define KHIGH  (4*KBATCH)
+
+// 每个cpu预清零页池的容量
+#define KZERO 16
+
 // 首先是多内存池创建和锁管理
 struct {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;   // freelist 中的页数
+  int nsteal;  // 本cpu发起窃取的次数
+  int nstolen; // 通过窃取搬运到本cpu的页数
+  struct run *zerolist; // 已清零的页（next 字段之外全为0）
+  int nzero;            // zerolist 中的页数
+  int nzhit;            // kalloc_zeroed() 命中预清零页的次数
+  int nzmiss;           // kalloc_zeroed() 只能现场清零的次数
 } kmem[NCPU]; // 将kmem修改为数组，这样每个cpu对应一份freelist和lock; 用cpuid来分配内存池
 
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(pg) ((void*)(KERNBASE + (uint64)(pg) * PGSIZE))
+
+// 伙伴系统。free[k] 是 2^k 页空闲块组成的双向循环链表（free[k] 本身是哨兵）。
+// order[pg] 不为0 表示第 pg 页是一个空闲块的首页，块大小为 2^(order[pg]-1) 页；
+// 在cpu缓存中或已分配出去的页 order[pg] 都是0，因此不会被合并。
+struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1];
+  int nfree[MAXORDER+1]; // 每个 order 的空闲块数
+  uchar order[NPAGE];
+} buddy;
+
+// 每个物理页的引用计数，只对已分配出去的页有意义。
+// 用原子操作修改，不需要加锁。
+static int kref[NPAGE];
+
 // void
 // kinit()
 // {
@@ -37,14 +90,39 @@ struct {
 // }
 
 // 初始化kmem时将每个cpu对应kmem[i]都初始化
+// 启动时先把所有物理内存交给伙伴系统（合并成尽量大的块），
+// 再把空闲页平均分给每个cpu的缓存，避免其他cpu一启动就要去抢。
+// 每个cpu分到总页数的 1/NCPU，但不超过cpu缓存的上限 KHIGH，
+// 其余留在伙伴系统里，以便分配连续的大块（超级页）。
 void
 kinit()
 {
+  int npages = 0, share;
+
   for(int i=0;i<NCPU;i++)
   {
       initlock(&kmem[i].lock, "kmem"); // 初始化所有锁
   }
-  freerange(end, (void*)PHYSTOP); // 默认将(所有)内存分配给运行这一函数的cpu
+  initlock(&buddy.lock, "kmem_buddy");
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
+  freerange(end, (void*)PHYSTOP);
+
+  for(int k = 0; k <= MAXORDER; k++)
+    npages += buddy.nfree[k] << k;
+  share = npages / NCPU;
+  if(share > KHIGH)
+    share = KHIGH;
+  for(int i = 0; i < NCPU; i++)
+    refill(i, share);
+
+  printf("kinit: free pages per cpu:");
+  for(int i = 0; i < NCPU; i++)
+    printf(" %d", kmem[i].nfree);
+  printf(", buddy blocks per order:");
+  for(int k = 0; k <= MAXORDER; k++)
+    printf(" %d", buddy.nfree[k]);
+  printf("\n");
 }
 
 void
@@ -52,8 +130,146 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&buddy.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddy_free(p, 0);
+  release(&buddy.lock);
+}
+
+// 把以 pa 开始的 2^order 页放回伙伴系统，并尽量与伙伴合并。
+// 调用者持有 buddy.lock。
+static void
+buddy_free(void *pa, int order)
+{
+  uint64 pg = PA2PG(pa);
+  struct run *r;
+
+  while(order < MAXORDER){
+    uint64 bpg = pg ^ (1L << order); // 伙伴块的首页
+    if(bpg >= NPAGE || buddy.order[bpg] != order+1)
+      break;
+    // 伙伴也空闲：从链表中摘下，合并成更大的块
+    r = (struct run*)PG2PA(bpg);
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    buddy.nfree[order]--;
+    buddy.order[bpg] = 0;
+    if(bpg < pg)
+      pg = bpg;
+    order++;
+  }
+
+  r = (struct run*)PG2PA(pg);
+  r->next = buddy.free[order].next;
+  r->prev = &buddy.free[order];
+  r->next->prev = r;
+  buddy.free[order].next = r;
+  buddy.nfree[order]++;
+  buddy.order[pg] = order+1;
+}
+
+// 从伙伴系统分配 2^order 页，必要时拆分更大的块。
+// 调用者持有 buddy.lock。没有足够大的块时返回0。
+static void *
+buddy_alloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(buddy.free[k].next != &buddy.free[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  r = buddy.free[k].next;
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  buddy.nfree[k]--;
+  buddy.order[PA2PG(r)] = 0;
+
+  // 把多余的后半部分依次放回低一级的链表
+  while(k > order){
+    k--;
+    struct run *half = (struct run*)((char*)r + (PGSIZE << k));
+    half->next = buddy.free[k].next;
+    half->prev = &buddy.free[k];
+    half->next->prev = half;
+    buddy.free[k].next = half;
+    buddy.nfree[k]++;
+    buddy.order[PA2PG(half)] = k+1;
+  }
+  return (void*)r;
+}
+
+// 从伙伴系统一次取最多 max 页（一般是 KBATCH）放入cpu i 的缓存，
+// 只加一次 buddy 锁。
+// 调用者已关中断，且不持有任何 kmem 锁。返回取到的页数。
+static int
+refill(int i, int max)
+{
+  struct run *list = 0, *r;
+  int n;
+
+  acquire(&buddy.lock);
+  for(n = 0; n < max; n++){
+    if((r = buddy_alloc(0)) == 0)
+      break;
+    r->next = list;
+    list = r;
+  }
+  release(&buddy.lock);
+
+  if(n == 0)
+    return 0;
+
+  acquire(&kmem[i].lock);
+  for(r = list; r->next; r = r->next)
+    ;
+  r->next = kmem[i].freelist;
+  kmem[i].freelist = list;
+  kmem[i].nfree += n;
+  release(&kmem[i].lock);
+  return n;
+}
+
+// 把一串单页（通过 next 相连）还给伙伴系统，只加一次 buddy 锁。
+static void
+buddy_freelist(struct run *list)
+{
+  struct run *r;
+
+  acquire(&buddy.lock);
+  while(list){
+    r = list;
+    list = r->next;
+    buddy_free(r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// 把所有cpu缓存（包括预清零页池）中的页都还给伙伴系统，
+// 让它们有机会合并成 kalloc_pages() 需要的大块。
+static void
+kdrain(void)
+{
+  struct run *list;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    list = kmem[i].freelist;
+    kmem[i].freelist = 0;
+    kmem[i].nfree = 0;
+    release(&kmem[i].lock);
+    buddy_freelist(list);
+
+    acquire(&kmem[i].lock);
+    list = kmem[i].zerolist;
+    kmem[i].zerolist = 0;
+    kmem[i].nzero = 0;
+    release(&kmem[i].lock);
+    buddy_freelist(list);
+  }
 }
 
 // Free the page of physical memory pointed at by v,
@@ -102,13 +318,22 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch = 0;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // 还有其他页表在共享这一页（COW），只减引用计数
+  int ref = __sync_sub_and_fetch(&kref[PA2PG(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
+#ifdef KALLOCDEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
   
@@ -117,11 +342,146 @@ kfree(void *pa)
   acquire(&kmem[i].lock); //获取锁以保证内存池的使用安全
   r->next = kmem[i].freelist;
   kmem[i].freelist = r;
+  kmem[i].nfree++;
+  if(kmem[i].nfree > KHIGH){
+    // 缓存太多了：摘下一批还给伙伴系统
+    batch = r = kmem[i].freelist;
+    for(int c = 1; c < KBATCH; c++)
+      r = r->next;
+    kmem[i].freelist = r->next;
+    kmem[i].nfree -= KBATCH;
+    r->next = 0;
+  }
   release(&kmem[i].lock);
+  if(batch)
+    buddy_freelist(batch);
   
   pop_off();//turn inturrupts on
 }
 
+// 一次释放 n 个页，和 n 次 kfree() 效果相同，
+// 但真正释放的页只加一次本cpu内存池的锁就全部放回。
+void
+kfree_batch(void **pa, int n)
+{
+  struct run *list = 0, *r, *batch = 0;
+  int nfreed = 0;
+
+  for(int k = 0; k < n; k++){
+    if(((uint64)pa[k] % PGSIZE) != 0 || (char*)pa[k] < end || (uint64)pa[k] >= PHYSTOP)
+      panic("kfree_batch");
+    int ref = __sync_sub_and_fetch(&kref[PA2PG(pa[k])], 1);
+    if(ref < 0)
+      panic("kfree_batch: ref");
+    if(ref > 0)
+      continue;
+#ifdef KALLOCDEBUG
+    memset(pa[k], 1, PGSIZE);
+#endif
+    r = (struct run*)pa[k];
+    r->next = list;
+    list = r;
+    nfreed++;
+  }
+  if(list == 0)
+    return;
+
+  push_off();
+  int i = cpuid();
+  for(r = list; r->next; r = r->next)
+    ;
+  acquire(&kmem[i].lock);
+  r->next = kmem[i].freelist;
+  kmem[i].freelist = list;
+  kmem[i].nfree += nfreed;
+  if(kmem[i].nfree > KHIGH){
+    // 把超出上限的部分一次摘下还给伙伴系统
+    int extra = kmem[i].nfree - (KHIGH - KBATCH);
+    batch = r = kmem[i].freelist;
+    for(int c = 1; c < extra; c++)
+      r = r->next;
+    kmem[i].freelist = r->next;
+    kmem[i].nfree -= extra;
+    r->next = 0;
+  }
+  release(&kmem[i].lock);
+  if(batch)
+    buddy_freelist(batch);
+  pop_off();
+}
+
+// 从其他cpu的内存池中批量窃取空闲页，挂到cpu i 的freelist上。
+// 每个被窃取的cpu只加一次锁，一次搬走它一半的页（至多 KSTEAL_MAX）。
+// 调用者已关中断，且不持有任何 kmem 锁。
+// 返回搬运的页数，0 表示所有内存池都为空。
+static int
+steal(int i)
+{
+  struct run *first, *last;
+  int n = 0;
+
+  for(int k = 1; k < NCPU && n == 0; k++){
+    int j = (i + k) % NCPU; // 从下一个cpu开始轮询，避免大家都去抢 kmem[0]
+    acquire(&kmem[j].lock);
+    if(kmem[j].nfree > 0){
+      n = kmem[j].nfree / 2;
+      if(n == 0)
+        n = 1;
+      if(n > KSTEAL_MAX)
+        n = KSTEAL_MAX;
+      // 从链表头摘下 n 页
+      first = last = kmem[j].freelist;
+      for(int c = 1; c < n; c++)
+        last = last->next;
+      kmem[j].freelist = last->next;
+      kmem[j].nfree -= n;
+    }
+    release(&kmem[j].lock);
+  }
+
+  if(n == 0)
+    return 0;
+
+  acquire(&kmem[i].lock);
+  last->next = kmem[i].freelist;
+  kmem[i].freelist = first;
+  kmem[i].nfree += n;
+  kmem[i].nsteal++;
+  kmem[i].nstolen += n;
+  release(&kmem[i].lock);
+  return n;
+}
+
+// 所有内存池和伙伴系统都空了：把各cpu的预清零页收回到cpu i 的freelist。
+// 调用者已关中断，且不持有任何 kmem 锁。返回收回的页数。
+static int
+zreclaim(int i)
+{
+  struct run *first, *last;
+  int n, tot = 0;
+
+  for(int k = 0; k < NCPU; k++){
+    int j = (i + k) % NCPU;
+    acquire(&kmem[j].lock);
+    first = kmem[j].zerolist;
+    n = kmem[j].nzero;
+    kmem[j].zerolist = 0;
+    kmem[j].nzero = 0;
+    release(&kmem[j].lock);
+    if(n == 0)
+      continue;
+    for(last = first; last->next; last = last->next)
+      ;
+    acquire(&kmem[i].lock);
+    last->next = kmem[i].freelist;
+    kmem[i].freelist = first;
+    kmem[i].nfree += n;
+    release(&kmem[i].lock);
+    tot += n;
+  }
+  return tot;
+}
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
@@ -133,37 +493,217 @@ kalloc(void)
 
   push_off();// turn interrupts off
   int i=cpuid();// core number
-  acquire(&kmem[i].lock);
-  r = kmem[i].freelist;
-  // 先从自己的内存池中寻找可用的内存块
-  if(r)
-  {
-    kmem[i].freelist = r->next; 
-  }
-  release(&kmem[i].lock);
+  for(;;){
+    acquire(&kmem[i].lock);
+    r = kmem[i].freelist;
+    // 先从自己的内存池中寻找可用的内存块
+    if(r)
+    {
+      kmem[i].freelist = r->next;
+      kmem[i].nfree--;
+    }
+    release(&kmem[i].lock);
 
-  if(!r) // 当前cpu对应freelist为空
-  {
-     for(int j=0;j<NCPU;j++) // 从其他cpu的freelist中借用
-     {
-       if(j!=i)
-       {
-          acquire(&kmem[j].lock); // 寻找前记得上锁
-          if(kmem[j].freelist)
-	  {
-	      r=kmem[j].freelist;
-              kmem[j].freelist=r->next; 	      
-	      release(&kmem[j].lock);
-	      break;
-	  }
-          release(&kmem[j].lock);
-       }
-     }
+    // 当前cpu对应freelist为空时，先从伙伴系统批量补充；
+    // 伙伴系统也空了，再从其他cpu批量借用一批页，然后重试。
+    // 这样接下来的若干次分配都不必再去碰别人的锁。
+    // 然后动用预清零页池，最后让块缓存和 inode 缓存释放一些没在用的。
+    if(r || (refill(i, KBATCH) == 0 && steal(i) == 0 && zreclaim(i) == 0 &&
+             bshrink() == 0 && ishrink() == 0))
+      break;
   }
-  
+
   pop_off();//turn on inturrupt
 
+  if(r)
+    kref[PA2PG(r)] = 1;
+#ifdef KALLOCDEBUG
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// 分配一个内容全为0的页。优先使用本cpu预清零页池中的页，
+// 池空时退回到 kalloc() 加 memset。
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  push_off();
+  int i = cpuid();
+  acquire(&kmem[i].lock);
+  r = kmem[i].zerolist;
+  if(r){
+    kmem[i].zerolist = r->next;
+    kmem[i].nzero--;
+    kmem[i].nzhit++;
+  } else {
+    kmem[i].nzmiss++;
+  }
+  release(&kmem[i].lock);
+  pop_off();
+
+  if(r){
+    r->next = 0; // 清零页中唯一被用过的字段
+    kref[PA2PG(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
-}
\ No newline at end of file
+}
+
+// 在cpu空闲时把本cpu的预清零页池补满。由 scheduler() 在 wfi 之前调用。
+// 只用本cpu缓存和伙伴系统中的页，不去窃取，
+// 否则内存紧张时会与 kalloc() 的 zreclaim() 来回搬页。
+void
+kzero_refill(void)
+{
+  struct run *r;
+
+  for(;;){
+    push_off();
+    int i = cpuid();
+    acquire(&kmem[i].lock);
+    if(kmem[i].nzero >= KZERO){
+      release(&kmem[i].lock);
+      pop_off();
+      return;
+    }
+    r = kmem[i].freelist;
+    if(r){
+      kmem[i].freelist = r->next;
+      kmem[i].nfree--;
+    }
+    release(&kmem[i].lock);
+    if(r == 0){
+      int n = refill(i, KBATCH);
+      pop_off();
+      if(n == 0)
+        return;
+      continue;
+    }
+
+    memset((char*)r, 0, PGSIZE);
+    acquire(&kmem[i].lock);
+    r->next = kmem[i].zerolist;
+    kmem[i].zerolist = r;
+    kmem[i].nzero++;
+    release(&kmem[i].lock);
+    pop_off();
+  }
+}
+
+// 分配 2^order 个物理上连续的页，首地址按块大小对齐。
+// order 为0时就是 kalloc()。
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pages(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  acquire(&buddy.lock);
+  pa = buddy_alloc(order);
+  release(&buddy.lock);
+  if(pa == 0){
+    // 大块可能被拆散在各cpu的缓存里，全部还回去合并后再试一次
+    kdrain();
+    acquire(&buddy.lock);
+    pa = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+
+  if(pa)
+    kref[PA2PG(pa)] = 1;
+#ifdef KALLOCDEBUG
+  if(pa)
+    memset(pa, 5, PGSIZE << order); // fill with junk
+#endif
+  return pa;
+}
+
+// 把 kalloc_pages(order) 分配的块拆成 2^order 个独立的页，
+// 之后可以分别用 kfree() 释放。块不能正被共享。
+void
+ksplit(void *pa, int order)
+{
+  uint64 pg = PA2PG(pa);
+
+  if(kref[pg] != 1)
+    panic("ksplit");
+  for(uint64 i = 1; i < (1L << order); i++)
+    kref[pg + i] = 1;
+}
+
+// 给一个已分配的页（或 kalloc_pages() 块）增加一个引用。
+void
+kaddref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kaddref");
+  if(__sync_fetch_and_add(&kref[PA2PG(pa)], 1) < 1)
+    panic("kaddref: free page");
+}
+
+// 返回页 pa 当前的引用计数。
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kref[PA2PG(pa)], __ATOMIC_SEQ_CST);
+}
+
+// 释放 kalloc_pages(order) 分配的块。
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER ||
+     ((uint64)pa - KERNBASE) % (PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  int ref = __sync_sub_and_fetch(&kref[PA2PG(pa)], 1);
+  if(ref < 0)
+    panic("kfree_pages: ref");
+  if(ref > 0)
+    return;
+
+#ifdef KALLOCDEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  acquire(&buddy.lock);
+  buddy_free(pa, order);
+  release(&buddy.lock);
+}
+
+// 输出每个cpu内存池的页数与窃取计数，供 statistics 设备使用
+int
+kmemstats(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- kmem steal stats\n");
+  for(int i = 0; i < NCPU; i++){
+    n += snprintf(buf+n, sz-n, "cpu %d: free %d steals %d stolen %d zeroed %d zhit %d zmiss %d\n",
+                  i, kmem[i].nfree, kmem[i].nsteal, kmem[i].nstolen,
+                  kmem[i].nzero, kmem[i].nzhit, kmem[i].nzmiss);
+  }
+  n += snprintf(buf+n, sz-n, "buddy: free blocks per order:");
+  for(int k = 0; k <= MAXORDER; k++)
+    n += snprintf(buf+n, sz-n, " %d", buddy.nfree[k]);
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
@@ -29,6 +29,13 @@
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// 写回是异步的：commit() 只写日志和日志头，提交过的块标记为脏、
+// 继续 pin 在缓存里，日志不清空；下一次提交接在后面追加
+// （同一块可能在日志里出现多次，恢复时按顺序安装，后面的覆盖前面的）。
+// 后台线程 log_flusher() 按块号顺序把它们写回原位置，再清空日志；
+// 日志满了时 begin_op() 自己写回。写回的时机可以用 logtune 系统调用调整
+// （见 logsetflush()）。
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -43,13 +50,21 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int flushing;    // in log_flush(), please wait.
   int dev;
   struct logheader lh;
+  int ncommit;     // lh.block[0..ncommit) 已经提交，还没写回原位置
+  uint oldest;     // 其中最早一次提交的时间（ticks）
+  uint deadline;   // log_flusher() 等到这个时间（ticks）写回，0 表示没有在等
+  int flushage;    // 提交过的块最多这么多个 tick 之后写回
+  int dirtyratio;  // 已提交未写回的块超过日志的这个百分比时写回
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void log_flush(void);
+static void log_flusher(void*);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -61,24 +76,50 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.flushage = FLUSHAGE;
+  log.dirtyratio = DIRTYRATIO;
   recover_from_log();
+  if(kthread_create(log_flusher, 0, "flusher") < 0)
+    panic("initlog: flusher");
 }
 
 // Copy committed blocks from log to their home location
+// 只在恢复时使用。先把所有日志块和目标块的读请求都发出去，
+// 再逐块拷贝、发出写请求，最后一起等待写完。
+// 同一块在日志里出现多次时只安装最后一次。
 static void
-install_trans(int recovering)
+install_trans(void)
 {
-  int tail;
+  struct buf *lbuf[LOGSIZE], *dbuf[LOGSIZE];
+  struct blkplug plug;
+  int tail, i;
 
+  blk_plug(&plug);  // 日志块是连续的，目标块排序之后也多半能合并
+  for (tail = 0; tail < log.lh.n; tail++) {
+    lbuf[tail] = dbuf[tail] = 0;
+    for (i = tail+1; i < log.lh.n; i++)
+      if (log.lh.block[i] == log.lh.block[tail])
+        break;
+    if (i < log.lh.n)
+      continue;
+    lbuf[tail] = bread_async(log.dev, log.start+tail+1); // read log block
+    dbuf[tail] = bread_async(log.dev, log.lh.block[tail]); // read dst
+  }
+  blk_unplug(&plug);
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+    if (lbuf[tail] == 0)
+      continue;
+    bwait(lbuf[tail]);
+    bwait(dbuf[tail]);
+    memmove(dbuf[tail]->data, lbuf[tail]->data, BSIZE);  // copy block to dst
+    bwrite_async(dbuf[tail]);  // write dst to disk
+    brelse(lbuf[tail]);
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    if (dbuf[tail] == 0)
+      continue;
+    bwait(dbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
@@ -117,7 +158,7 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
+  install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
   write_head(); // clear the log
 }
@@ -128,11 +169,19 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.flushing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+      // 没有进行中的操作时，日志里全是已提交未写回的块：
+      // 不等后台线程，自己写回（写得太快的进程在这里被限流）。
+      if(log.outstanding == 0){
+        release(&log.lock);
+        log_flush();
+        acquire(&log.lock);
+      } else {
+        sleep(&log, &log.lock);
+      }
     } else {
       log.outstanding += 1;
       release(&log.lock);
@@ -175,31 +224,184 @@ end_op(void)
 }
 
 // Copy modified blocks from cache to log.
+// 只写本次事务的块，接在已提交的块后面。
+// 和 install_trans() 一样先发出全部请求，最后一起等待；
+// write_head() 要在所有日志块都写完之后才能提交。
 static void
 write_log(void)
 {
+  struct buf *to[LOGSIZE];
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+  // 日志块在磁盘上是连续的，读和写都合并成尽量少的请求
+  breadv_async(log.dev, log.start+log.ncommit+1, log.lh.n-log.ncommit,
+               &to[log.ncommit]); // log blocks
+  for (tail = log.ncommit; tail < log.lh.n; tail++) {
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    bwait(to[tail]);
+    memmove(to[tail]->data, from->data, BSIZE);
+    from->dirty = 1;  // 提交之后由 log_flush() 写回原位置
     brelse(from);
-    brelse(to);
+  }
+  bwritev_async(&to[log.ncommit], log.lh.n-log.ncommit);  // write the log
+  for (tail = log.ncommit; tail < log.lh.n; tail++) {
+    bwait(to[tail]);
+    brelse(to[tail]);
   }
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
+  if (log.lh.n > log.ncommit) {
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+    acquire(&log.lock);
+    if (log.ncommit == 0)
+      log.oldest = ticks;
+    // 写回交给 log_flush()。第一次提交时叫醒 log_flusher() 让它开始计时，
+    // 超过比例时叫醒它马上写回。
+    if (log.ncommit == 0 || log.lh.n*100 >= log.dirtyratio*LOGSIZE)
+      wakeup(&log.ncommit);
+    log.ncommit = log.lh.n;
+    release(&log.lock);
+  }
+}
+
+// 把已提交的块按块号顺序写回原位置，然后清空磁盘上的日志。
+// 要等进行中的操作都结束，期间 begin_op() 等待。
+static void
+log_flush(void)
+{
+  struct buf *b[LOGSIZE];
+  int blk[LOGSIZE], npin[LOGSIZE];
+  int i, j, n;
+
+  acquire(&log.lock);
+  if(log.flushing){
+    // 别人正在写回，等它写完就行
+    while(log.flushing)
+      sleep(&log, &log.lock);
+    release(&log.lock);
+    return;
+  }
+  log.flushing = 1;
+  while(log.outstanding > 0 || log.committing)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+
+  if(log.ncommit > 0){
+    // 去重并按块号排序；同一块提交了几次就被 pin 了几次
+    n = 0;
+    for(i = 0; i < log.ncommit; i++){
+      int bno = log.lh.block[i];
+      for(j = 0; j < n && blk[j] < bno; j++)
+        ;
+      if(j < n && blk[j] == bno){
+        npin[j]++;
+        continue;
+      }
+      memmove(&blk[j+1], &blk[j], (n-j)*sizeof(blk[0]));
+      memmove(&npin[j+1], &npin[j], (n-j)*sizeof(npin[0]));
+      blk[j] = bno;
+      npin[j] = 1;
+      n++;
+    }
+
+    for(i = 0; i < n; i++)
+      b[i] = bread(log.dev, blk[i]);  // pin 在缓存里，不会读盘
+    bwritev_async(b, n);  // 按块号排好了，连续的块合并成一个请求
+    for(i = 0; i < n; i++){
+      bwait(b[i]);
+      b[i]->dirty = 0;
+      for(j = 0; j < npin[i]; j++)
+        bunpin(b[i]);
+      brelse(b[i]);
+    }
+
+    acquire(&log.lock);
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.ncommit = 0;
+    release(&log.lock);
+    write_head();    // Erase the transactions from the log
   }
+
+  acquire(&log.lock);
+  log.flushing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// 已提交的块是否该写回了。调用者持有 log.lock。
+static int
+flushdue(void)
+{
+  return log.ncommit > 0 && !log.flushing &&
+         (ticks - log.oldest >= log.flushage || log.ncommit*100 >= log.dirtyratio*LOGSIZE);
+}
+
+// 后台写回线程：最早的一次提交已经过了 flushage 个周期，或者已提交未写回的块
+// 占了日志的 dirtyratio% 以上，就写回。没有已提交的块时只等 commit() 叫醒；
+// 有的话设好期限，到期时由时钟中断里的 log_tick() 叫醒。
+static void
+log_flusher(void *arg)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(flushdue()){
+      log.deadline = 0;
+      release(&log.lock);
+      log_flush();
+      acquire(&log.lock);
+      continue;
+    }
+    log.deadline = log.ncommit > 0 ? log.oldest + log.flushage : 0;
+    sleep(&log.ncommit, &log.lock);
+  }
+}
+
+// 时钟中断里调用，持有 tickslock。过了期限就叫醒 log_flusher()；
+// 它可能还没睡下，所以每个周期都叫，直到它写回、清掉期限。
+void
+log_tick(void)
+{
+  uint d = log.deadline;
+
+  if(d != 0 && (int)(ticks - d) >= 0)
+    wakeup(&log.ncommit);
+}
+
+// 设置写回的期限（tick 数）和比例（百分比），<= 0 的参数表示不变。
+// 成功返回0，比例超过 100 时返回 -1。
+int
+logsetflush(int age, int ratio)
+{
+  if(ratio > 100)
+    return -1;
+  acquire(&log.lock);
+  if(age > 0)
+    log.flushage = age;
+  if(ratio > 0)
+    log.dirtyratio = ratio;
+  wakeup(&log.ncommit);  // 按新的设置重新算
+  release(&log.lock);
+  return 0;
+}
+
+// 输出日志的写回状态，接在 bcachestat 设备的后面：已提交未写回的块数、
+// 本次事务里的块数、最早一次提交过了多少 tick，以及 logsetflush() 的两个设置。
+int
+logstat(char *buf, int sz)
+{
+  int n;
+
+  acquire(&log.lock);
+  n = snprintf(buf, sz, "log: committed %d pending %d age %d flushage %d dirtyratio %d\n",
+               log.ncommit, log.lh.n - log.ncommit,
+               log.ncommit > 0 ? (int)(ticks - log.oldest) : 0,
+               log.flushage, log.dirtyratio);
+  release(&log.lock);
+  return n;
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -223,7 +425,8 @@ log_write(struct buf *b)
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
+  // 只能并入本次事务的块，已提交的那些不能改
+  for (i = log.ncommit; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorption
       break;
   }
@@ -12,9 +12,7 @@ main()
 {
   if(cpuid() == 0){
     consoleinit();
-#if defined(LAB_LOCK)
     statsinit();
-#endif
     printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
@@ -22,6 +20,7 @@ main()
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    tlbinit();       // ASID allocator
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -30,7 +29,9 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(); // emulated hard disk
+    blkinit();       // block request queues, one per virtio queue
 #ifdef LAB_NET
     pci_init();
     sockinit();
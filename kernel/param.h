@@ -2,13 +2,18 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // 引用计数为0、仍然缓存着的 inode 个数上限
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
+#define FLUSHAGE     30  // 提交过的块最多这么多个 tick 之后写回（默认值，logtune 可改）
+#define DIRTYRATIO   50  // 已提交未写回的块超过日志的这个百分比时写回（默认值，logtune 可改）
 // #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define NBUF         (MAXOPBLOCKS*24)  // size of disk block cache 修改了之后，bcachetest的 test0才ok
+#define NBUF         (MAXOPBLOCKS*24)  // initial size of disk block cache 修改了之后，bcachetest的 test0才ok
+#define BUFMIN       (LOGSIZE*3)       // 缓存块个数的下限：提交和恢复时要同时持有两倍日志大小的块
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest kalloc_pages() block is 2^MAXORDER pages
+#define HEAPSUPERPG  1     // 堆的缺页在整个 2MB 块都属于堆时直接映射大页；设为0只用 4KB 页
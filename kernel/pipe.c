@@ -7,6 +7,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
 #define PIPESIZE 512
 
@@ -19,6 +20,15 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+// struct pipe 只有五百多字节，从 slab 分配，一页可以放7个。
+struct kmem_cache pipecache;
+
+void
+pipeinit(void)
+{
+  kmem_cache_init(&pipecache, "pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +38,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(&pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +57,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -71,7 +81,7 @@ pipeclose(struct pipe *pi, int writable)
 #ifdef LAB_LOCK
     freelock(&pi->lock);
 #endif    
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   } else
     release(&pi->lock);
 }
@@ -17,6 +17,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -175,6 +176,10 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->asidgen = 0;
+  p->kfn = 0;
+  p->karg = 0;
+  p->plug = 0;
   p->state = UNUSED;
 }
 
@@ -264,16 +269,22 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // lazy: only reserve the address space; pages are
+    // allocated on first touch by lazyalloc().
+    if(sz + n > TRAPFRAME)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // fails only if freeing part of a superpage needs a
+    // page-table page and there is no memory for it.
+    if(uvmdealloc(p->pagetable, sz, sz + n) != sz + n)
+      return -1;
+    sz += n;
   }
   p->sz = sz;
   return 0;
@@ -400,10 +411,11 @@ exit(int status)
       }
       
       p->sz -= p->vmas[i].length;  
-      p->vmas[i].f->ref--;
+      fileclose(p->vmas[i].f); // file 由 slab 分配，引用归零时需要真正释放
+      p->vmas[i].f = 0;
 
       pte_t *pte = walk(p->pagetable, p->vmas[i].addr, 0);
-      if((*pte & PTE_V) == 0) // don't write and uvmunmap(), only change data of vma
+      if(pte == 0 || (*pte & PTE_V) == 0) // don't write and uvmunmap(), only change data of vma
         continue;        
 
       uvmunmap(p->pagetable, p->vmas[i].addr, p->vmas[i].length/PGSIZE, 1);
@@ -505,7 +517,7 @@ scheduler(void)
     int nproc = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
-      if(p->state != UNUSED) {
+      if(p->state != UNUSED && p->kfn == 0) {
         nproc++;
       }
       if(p->state == RUNNABLE) {
@@ -524,6 +536,7 @@ scheduler(void)
     }
     if(nproc <= 2) {   // only init and sh exist
       intr_on();
+      kzero_refill();  // 空闲时预先清零一些页，供缺页和 sbrk 使用
       asm volatile("wfi");
     }
   }
@@ -561,6 +574,7 @@ void
 yield(void)
 {
   struct proc *p = myproc();
+  blk_flush();  // 见 blk.c
   acquire(&p->lock);
   p->state = RUNNABLE;
   sched();
@@ -588,12 +602,48 @@ forkret(void)
   usertrapret();
 }
 
+// 创建一个只在内核里运行的线程，从 fn(arg) 开始执行，fn 不能返回。
+// 它和普通进程一样被调度、可以 sleep()，只是永远不回到用户态。
+// 返回 pid，没有空闲的 proc 时返回 -1。
+int
+kthread_create(void (*fn)(void*), void *arg, char *name)
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  p->kfn = fn;
+  p->karg = arg;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  pid = p->pid;
+  release(&p->lock);
+  return pid;
+}
+
+// 内核线程第一次被调度时从这里开始。
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn(p->karg);
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+
+  // 睡之前把本进程 plug 里攒着的块请求发出去，见 blk.c
+  blk_flush();
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
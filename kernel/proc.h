@@ -116,5 +116,11 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int asid;                    // ASID in satp, valid if asidgen is current (tlb.c)
+  uint64 asidgen;              // ASID generation asid belongs to; 0 if none
+  int tlbcpu;                  // CPU that last entered user space with asid
   struct vma_t vmas[16];       // VMAs helps the kernel to decide how to handle page faults
+  void (*kfn)(void*);          // 内核线程的入口，普通进程为0
+  void *karg;                  // kfn 的参数
+  struct blkplug *plug;        // blk_plug() 之后攒请求的地方，0 表示没有
 };
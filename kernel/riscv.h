@@ -197,6 +197,7 @@ w_pmpaddr0(uint64 x)
 #define SATP_SV39 (8L << 60)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define SATP_ASID(asid) (((uint64)(asid)) << 44)
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -331,6 +332,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// flush the TLB entries for va in one address space.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
@@ -338,12 +353,19 @@ sfence_vma()
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define SUPERPGSIZE (1L << 21) // bytes mapped by a level-1 leaf PTE
+#define SUPERPGORDER 9         // a superpage is 2^9 pages
+#define SUPERPGROUNDUP(sz)  (((sz)+SUPERPGSIZE-1) & ~(SUPERPGSIZE-1))
+#define SUPERPGROUNDDOWN(a) (((a)) & ~(SUPERPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
 // #define PTE_D (1L << 7) // 1 -> dirty page
+#define PTE_COW (1L << 8) // RSW 位：写时复制的共享页，写时再复制
+#define PTE_S (1L << 9)   // RSW 位：2MB 大页（level-1 叶子）；传给 mappages() 表示按大页映射
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,175 @@
+// Slab allocator: carves kalloc() pages into objects of one size.
+// See slab.h.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "slab.h"
+#include "defs.h"
+
+// slab 页的页头
+struct slab {
+  struct slab *next;        // cache->partial 链表
+  struct slab *prev;
+  struct kmem_cache *cache;
+  void *freelist;           // 页内空闲对象，每个空闲对象的前8字节指向下一个
+  int inuse;                // 已分配出去的对象数
+};
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  initlock(&c->lock, "kmem_cache");
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  if(c->size < sizeof(void*) || c->size > PGSIZE - SLABHDR)
+    panic("kmem_cache_init: size");
+  c->perslab = (PGSIZE - SLABHDR) / c->size;
+  c->partial = 0;
+  c->nslab = 0;
+  c->nobj = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->mag[i].n = 0;
+}
+
+static void
+partial_remove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+static void
+partial_insert(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// 分配一个新的 slab 页并把其中的对象串成空闲链表。
+// 调用者持有 c->lock。
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->freelist = 0;
+  obj = (char*)s + SLABHDR + (c->perslab - 1) * c->size;
+  for(; obj >= (char*)s + SLABHDR; obj -= c->size){
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+  }
+  partial_insert(c, s);
+  c->nslab++;
+  return s;
+}
+
+// 从 slab 中取最多 n 个对象放进弹匣。调用者持有 c->lock。
+static void
+mag_refill(struct kmem_cache *c, int cpu, int n)
+{
+  struct slab *s;
+  void *obj;
+
+  while(n-- > 0){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    obj = s->freelist;
+    s->freelist = *(void**)obj;
+    if(++s->inuse == c->perslab)
+      partial_remove(c, s); // 满了，不再留在 partial 链表中
+    c->mag[cpu].objs[c->mag[cpu].n++] = obj;
+  }
+}
+
+// 把弹匣顶部的 n 个对象还给各自的 slab。调用者持有 c->lock。
+// 除了最后一个空 slab 外，空 slab 的页还给 kalloc。
+static void
+mag_flush(struct kmem_cache *c, int cpu, int n)
+{
+  struct slab *s;
+  void *obj;
+
+  while(n-- > 0){
+    obj = c->mag[cpu].objs[--c->mag[cpu].n];
+    s = (struct slab*)PGROUNDDOWN((uint64)obj);
+    if(s->cache != c)
+      panic("kmem_cache_free: wrong cache");
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+    if(s->inuse-- == c->perslab)
+      partial_insert(c, s); // 由满变为不满
+    if(s->inuse == 0 && (s->prev || s->next)){
+      partial_remove(c, s);
+      c->nslab--;
+      kfree((void*)s);
+    }
+  }
+}
+
+// 分配一个对象。内容未初始化。
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *obj = 0;
+
+  push_off();
+  int cpu = cpuid();
+  if(c->mag[cpu].n == 0){
+    acquire(&c->lock);
+    mag_refill(c, cpu, MAGSIZE/2);
+    release(&c->lock);
+  }
+  if(c->mag[cpu].n > 0){
+    obj = c->mag[cpu].objs[--c->mag[cpu].n];
+    __sync_fetch_and_add(&c->nobj, 1);
+  }
+  pop_off();
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  push_off();
+  int cpu = cpuid();
+  if(c->mag[cpu].n == MAGSIZE){
+    acquire(&c->lock);
+    mag_flush(c, cpu, MAGSIZE/2);
+    release(&c->lock);
+  }
+  c->mag[cpu].objs[c->mag[cpu].n++] = obj;
+  __sync_fetch_and_sub(&c->nobj, 1);
+  pop_off();
+}
+
+// 把本cpu弹匣中的对象全部还给 slab，空 slab 的页还给 kalloc。
+// 用于释放了一批对象、希望马上回收内存的时候。
+void
+kmem_cache_drain(struct kmem_cache *c)
+{
+  push_off();
+  int cpu = cpuid();
+  acquire(&c->lock);
+  mag_flush(c, cpu, c->mag[cpu].n);
+  release(&c->lock);
+  pop_off();
+}
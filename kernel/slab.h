@@ -0,0 +1,26 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// 每种对象一个 kmem_cache。对象从 kalloc() 得到的整页（slab）中切出，
+// slab 页开头是 struct slab 头，后面紧跟着对象。
+// 每个cpu在 cache 前面有一个对象弹匣（magazine），
+// 分配和释放通常只动本cpu的弹匣，不需要加锁；
+// 弹匣空了或满了才拿 cache 的锁，与 slab 批量交换 MAGSIZE/2 个对象。
+
+#define MAGSIZE 16
+
+struct slab;
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;           // 用于调试
+  uint size;            // 对象大小（按8字节对齐）
+  uint perslab;         // 每个 slab 页能放的对象数
+  struct slab *partial; // 还有空闲对象的 slab（双向链表）
+  int nslab;            // 持有的 slab 页数
+  int nobj;             // 已分配出去的对象数（含弹匣中的）
+
+  struct {
+    void *objs[MAGSIZE];
+    int n;
+  } mag[NCPU];          // 每个cpu的对象弹匣，仅在关中断时访问
+};
@@ -16,15 +16,19 @@ initsleeplock(struct sleeplock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
+  lk->nshared = 0;
+  lk->wwait = 0;
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->wwait++;
+  while (lk->locked || lk->nshared > 0) {
     sleep(lk, &lk->lk);
   }
+  lk->wwait--;
   lk->locked = 1;
   lk->pid = myproc()->pid;
   release(&lk->lk);
@@ -40,6 +44,41 @@ releasesleep(struct sleeplock *lk)
   release(&lk->lk);
 }
 
+// 以共享方式获取锁：没有独占的持有者、也没有人在等独占时就可以拿到。
+void
+acquiresleep_shared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  while (lk->locked || lk->wwait > 0) {
+    sleep(lk, &lk->lk);
+  }
+  lk->nshared++;
+  release(&lk->lk);
+}
+
+void
+releasesleep_shared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->nshared <= 0)
+    panic("releasesleep_shared");
+  if(--lk->nshared == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// 把持有的独占锁换成共享锁，中间不会被别的写者插进来。
+void
+downgradesleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->locked = 0;
+  lk->pid = 0;
+  lk->nshared++;
+  wakeup(lk);
+  release(&lk->lk);
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -15,6 +15,10 @@ struct sleeplock {
   // 用于调试目的:
   char *name;        // 锁的名称，可以标识这个特定的sleeplock实例
   int pid;           // Process holding lock
+
+  // 共享模式：只读的持有者可以同时有多个（不记录 pid）
+  int nshared;       // 以共享方式持有锁的进程数
+  int wwait;         // 等待独占的进程数；有人在等时新的共享请求也要等，免得写者饿死
 };
 
 /*
@@ -39,7 +39,8 @@ findslot(struct spinlock *lk) {
       return;
     }
   }
-  panic("findslot");
+  // 表满了（块缓存可以增长到很多块）：这个锁就不计入统计
+  release(&lock_locks);
 }
 #endif
 
@@ -204,11 +205,13 @@ statslock(char *buf, int sz) {
   n = snprintf(buf, sz, "--- lock kmem/bcache stats\n");
   for(int i = 0; i < NLOCK; i++) {
     if(locks[i] == 0)
-      break;
+      continue;   // 动态分配的对象释放锁后会留下空位
     if(strncmp(locks[i]->name, "bcache", strlen("bcache")) == 0 ||
        strncmp(locks[i]->name, "kmem", strlen("kmem")) == 0) {
       tot += locks[i]->nts;
-      n += snprint_lock(buf +n, sz-n, locks[i]);
+      // 桶锁有几十上百个，只列出发生过竞争的，输出才放得进缓冲区
+      if(locks[i]->nts > 0)
+        n += snprint_lock(buf +n, sz-n, locks[i]);
     }
   }
   
@@ -219,8 +222,8 @@ statslock(char *buf, int sz) {
     int top = 0;
     for(int i = 0; i < NLOCK; i++) {
       if(locks[i] == 0)
-        break;
-      if(locks[i]->nts > locks[top]->nts && locks[i]->nts < last) {
+        continue;
+      if((locks[top] == 0 || locks[i]->nts > locks[top]->nts) && locks[i]->nts < last) {
         top = i;
       }
     }
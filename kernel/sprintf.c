@@ -18,24 +18,19 @@ sputc(char *s, char c)
   return 1;
 }
 
+// print x in base; neg prepends a minus sign.
 static int
-sprintint(char *s, int xx, int base, int sign)
+sprintnum(char *s, uint64 x, int base, int neg)
 {
-  char buf[16];
+  char buf[24];
   int i, n;
-  uint x;
-
-  if(sign && (sign = xx < 0))
-    x = -xx;
-  else
-    x = xx;
 
   i = 0;
   do {
     buf[i++] = digits[x % base];
   } while((x /= base) != 0);
 
-  if(sign)
+  if(neg)
     buf[i++] = '-';
 
   n = 0;
@@ -44,6 +39,14 @@ sprintint(char *s, int xx, int base, int sign)
   return n;
 }
 
+static int
+sprintint(char *s, int xx, int base, int sign)
+{
+  if(sign && xx < 0)
+    return sprintnum(s, -(long)xx, base, 1);
+  return sprintnum(s, (uint)xx, base, 0);
+}
+
 int
 snprintf(char *buf, int sz, char *fmt, ...)
 {
@@ -71,6 +74,21 @@ snprintf(char *buf, int sz, char *fmt, ...)
     case 'x':
       off += sprintint(buf+off, va_arg(ap, int), 16, 1);
       break;
+    case 'l':
+      // 64-bit: %ld, %lu, %lx
+      c = fmt[i+1] & 0xff;
+      if(c == 'd'){
+        long l = va_arg(ap, long);
+        off += sprintnum(buf+off, l < 0 ? -l : l, 10, l < 0);
+      } else if(c == 'u' || c == 'x'){
+        off += sprintnum(buf+off, va_arg(ap, uint64), c == 'u' ? 10 : 16, 0);
+      } else {
+        off += sputc(buf+off, '%');
+        off += sputc(buf+off, 'l');
+        break;
+      }
+      i++;
+      break;
     case 's':
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
@@ -10,15 +10,30 @@
 #include "defs.h"
 
 #define BUFSZ 4096
-static struct {
+#define BSTATSZ (8*BUFSZ)   // 最多 256 个桶，每个桶一行
+
+// 一个统计设备的输出缓冲：第一次 read 时生成全部内容，读完后清空
+struct statbuf {
   struct spinlock lock;
-  char buf[BUFSZ];
+  char *buf;
+  int cap;
   int sz;
   int off;
-} stats;
+};
+
+static char statsbuf[BUFSZ];
+static char bstatsbuf[BSTATSZ];
+static struct statbuf stats = { .buf = statsbuf, .cap = BUFSZ };    // statistics
+static struct statbuf bstats = { .buf = bstatsbuf, .cap = BSTATSZ }; // bcachestat
+static char iostatsbuf[BSTATSZ];
+static struct statbuf iostats = { .buf = iostatsbuf, .cap = BSTATSZ }; // iostat
 
 int statscopyin(char*, int);
 int statslock(char*, int);
+int kmemstats(char*, int);
+int tlbstats(char*, int);
+int bcachestats(char*, int);
+int bcachestat(char*, int);
   
 int
 statswrite(int user_src, uint64 src, int n)
@@ -26,44 +41,114 @@ statswrite(int user_src, uint64 src, int n)
   return -1;
 }
 
-int
-statsread(int user_dst, uint64 dst, int n)
+// 从 s 读最多 n 字节；s 为空时先用 fill() 生成内容。
+// 读完之后返回 -1，并清空 s，下一次 read 重新生成。
+static int
+statbufread(struct statbuf *s, int (*fill)(char*, int), int user_dst, uint64 dst, int n)
 {
   int m;
 
-  acquire(&stats.lock);
+  acquire(&s->lock);
 
-  if(stats.sz == 0) {
-#ifdef LAB_PGTBL
-    stats.sz = statscopyin(stats.buf, BUFSZ);
-#endif
-#ifdef LAB_LOCK
-    stats.sz = statslock(stats.buf, BUFSZ);
-#endif
-  }
-  m = stats.sz - stats.off;
+  if(s->sz == 0)
+    s->sz = fill(s->buf, s->cap);
+  m = s->sz - s->off;
 
   if (m > 0) {
     if(m > n)
       m  = n;
-    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) != -1) {
-      stats.off += m;
+    if(either_copyout(user_dst, dst, s->buf+s->off, m) != -1) {
+      s->off += m;
     }
   } else {
     m = -1;
-    stats.sz = 0;
-    stats.off = 0;
+    s->sz = 0;
+    s->off = 0;
   }
-  release(&stats.lock);
+  release(&s->lock);
   return m;
 }
 
+static int
+statsfill(char *buf, int sz)
+{
+  int n = 0;
+
+#ifdef LAB_PGTBL
+  n = statscopyin(buf, sz);
+#endif
+#ifdef LAB_LOCK
+  n = statslock(buf, sz);
+#endif
+  n += tlbstats(buf+n, sz-n);
+  n += kmemstats(buf+n, sz-n);
+  n += bcachestats(buf+n, sz-n);
+  return n;
+}
+
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  return statbufread(&stats, statsfill, user_dst, dst, n);
+}
+
+// 缓存的统计后面接着预读和替换、请求队列、磁盘等待时间和日志写回的统计
+static int
+bcachestatfill(char *buf, int sz)
+{
+  int n;
+
+  n = bcachestat(buf, sz);
+  n += bcachestats(buf+n, sz-n);
+  n += blkstat(buf+n, sz-n);
+  n += virtio_disk_stat(buf+n, sz-n);
+  n += logstat(buf+n, sz-n);
+  return n;
+}
+
+int
+bcachestatread(int user_dst, uint64 dst, int n)
+{
+  return statbufread(&bstats, bcachestatfill, user_dst, dst, n);
+}
+
+int
+iostatread(int user_dst, uint64 dst, int n)
+{
+  return statbufread(&iostats, iostat, user_dst, dst, n);
+}
+
+// 写入调度策略的名字（"noop" 或 "deadline"，可以带换行）切换请求队列的策略。
+// 单独写一个换行（echo 的最后一次 write）什么也不做。
+int
+bcachestatwrite(int user_src, uint64 src, int n)
+{
+  char name[16];
+  int m = n < sizeof(name)-1 ? n : sizeof(name)-1;
+
+  if(either_copyin(name, user_src, src, m) == -1)
+    return -1;
+  name[m] = 0;
+  if(m > 0 && name[m-1] == '\n')
+    name[--m] = 0;
+  if(m == 0)
+    return n;
+  if(blk_setpolicy(name) < 0)
+    return -1;
+  return n;
+}
+
 void
 statsinit(void)
 {
   initlock(&stats.lock, "stats");
+  initlock(&bstats.lock, "bcachestat");
+  initlock(&iostats.lock, "iostat");
 
   devsw[STATS].read = statsread;
   devsw[STATS].write = statswrite;
+  devsw[BCACHESTAT].read = bcachestatread;
+  devsw[BCACHESTAT].write = bcachestatwrite;
+  devsw[IOSTAT].read = iostatread;
+  devsw[IOSTAT].write = statswrite;
 }
-
@@ -22,3 +22,5 @@
 #define SYS_close  21
 #define SYS_mmap   22
 #define SYS_munmap 23
+#define SYS_bcachelimit 24
+#define SYS_logtune 25
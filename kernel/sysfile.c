@@ -575,7 +575,7 @@ sys_munmap(void)
     offset = p->vmas[i].offset;
   // If an unmapped page has been modified and the file is mapped MAP_SHARED,
   // write the page back to the file.
-  if((*pte & PTE_V) && p->vmas[i].flags & MAP_SHARED){
+  if(pte && (*pte & PTE_V) && p->vmas[i].flags & MAP_SHARED){
     begin_op();
     ilock(p->vmas[i].f->ip);
     writei(p->vmas[i].f->ip, 1, addr, offset, length); 
@@ -603,7 +603,7 @@ sys_munmap(void)
   }
   else if(length == p->vmas[i].length){
     p->sz -= length;  
-    p->vmas[i].f->ref--;
+    fileclose(p->vmas[i].f);
     p->vmas[i].f = 0;
     p->vmas[i].addr = 0;
     p->vmas[i].prot = 0;
@@ -614,7 +614,7 @@ sys_munmap(void)
   else
     return -1;
 
-  if((*pte & PTE_V) == 0) // don't write and uvmunmap(), only change data of vma
+  if(pte == 0 || (*pte & PTE_V) == 0) // don't write and uvmunmap(), only change data of vma
     return 0;
   // uvmunmap() after writing
   // find the VMA for the address range and unmap the specified pages
@@ -623,3 +623,25 @@ sys_munmap(void)
   // success, ret 0
   return 0;
 }
+
+// 设置块缓存的块数下限和上限（<= 0 表示不变），返回当前的块数。
+uint64
+sys_bcachelimit(void)
+{
+  int min, max;
+
+  if(argint(0, &min) < 0 || argint(1, &max) < 0)
+    return -1;
+  return bsetlimit(min, max);
+}
+
+// 设置日志写回的期限和比例（<= 0 表示不变），见 logsetflush()。
+uint64
+sys_logtune(void)
+{
+  int age, ratio;
+
+  if(argint(0, &age) < 0 || argint(1, &ratio) < 0)
+    return -1;
+  return logsetflush(age, ratio);
+}
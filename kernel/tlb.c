@@ -0,0 +1,169 @@
+// Address-space identifiers (ASIDs).
+//
+// 每个进程的 satp 中带一个 ASID，TLB 里不同 ASID 的表项互不干扰，
+// 所以进出内核、切换进程时都不必刷新整个 TLB。ASID 0 留给内核页表。
+//
+// ASID 按"代"（generation）分配：一代之内依次发放，发完后开启新的一代，
+// 所有进程手里的旧 ASID 作废，下次返回用户态时重新分配；
+// 每个cpu在开始使用新一代 ASID 之前刷新一次整个 TLB。
+// 进程换了cpu时，只刷新它自己的 ASID，因为它在别的cpu上运行时
+// 可能修改过页表，而这个cpu上还缓存着旧的表项。
+//
+// 硬件不支持 ASID 时 asids.max 为0，由 trampoline.S 在每次切换页表时
+// 刷新整个 TLB。
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+extern pagetable_t kernel_pagetable;
+
+// tlb_flush_range() 对不超过这么多页的范围逐页刷新，
+// 更大的范围直接刷新整个 ASID。
+#define TLBFLUSH_MAX 16
+
+// 每个cpu发出的 sfence.vma 次数，只在关中断时修改
+struct {
+  uint64 page;  // 单页
+  uint64 asid;  // 整个 ASID
+  uint64 all;   // 整个 TLB
+  uint64 range; // tlb_flush_range() 调用次数
+} tlbstat[NCPU];
+
+struct {
+  struct spinlock lock;
+  uint64 gen;       // 当前代，从1开始；进程的 asidgen 为0 表示还没有 ASID
+  int next;         // 本代下一个可分配的 ASID
+  int max;          // 硬件实现的最大 ASID
+  char stale[NCPU]; // 开启新一代后，该cpu还没有刷新过 TLB
+} asids;
+
+// 在 hart 0 打开分页之后调用。
+void
+tlbinit(void)
+{
+  initlock(&asids.lock, "asid");
+  // 往 satp 的 ASID 字段写全1再读回，没有实现的位读回来是0
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xFFFF));
+  asids.max = (r_satp() >> 44) & 0xFFFF;
+  w_satp(MAKE_SATP(kernel_pagetable));
+  sfence_vma();
+  asids.gen = 1;
+  asids.next = 1;
+  printf("tlbinit: %d asids\n", asids.max);
+}
+
+// 返回进程 p 回到用户态时使用的 satp。
+// 必要时给 p 分配新的 ASID，并刷新本cpu TLB 中可能过时的表项。
+// 由 usertrapret() 在关中断时调用。
+uint64
+tlb_activate(struct proc *p)
+{
+  int cpu = cpuid();
+  int flushall = 0;
+
+  if(asids.max == 0)
+    return MAKE_SATP(p->pagetable);
+
+  // 常见情况：ASID 仍然有效，不需要加锁
+  if(p->asidgen != __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE) ||
+     __atomic_load_n(&asids.stale[cpu], __ATOMIC_ACQUIRE)){
+    acquire(&asids.lock);
+    if(p->asidgen != asids.gen){
+      if(asids.next > asids.max){
+        asids.gen++;
+        asids.next = 1;
+        for(int i = 0; i < NCPU; i++)
+          asids.stale[i] = 1;
+      }
+      p->asid = asids.next++;
+      p->asidgen = asids.gen;
+      p->tlbcpu = cpu; // 本代中这个 ASID 还没有在任何cpu上用过
+    }
+    flushall = asids.stale[cpu];
+    asids.stale[cpu] = 0;
+    release(&asids.lock);
+  }
+
+  if(flushall){
+    sfence_vma();
+    tlbstat[cpu].all++;
+  } else if(p->tlbcpu != cpu){
+    sfence_vma_asid(p->asid);
+    tlbstat[cpu].asid++;
+  }
+  p->tlbcpu = cpu;
+  return MAKE_SATP(p->pagetable) | SATP_ASID(p->asid);
+}
+
+// va 在 pagetable 中的 PTE 被修改了，丢弃本cpu TLB 中缓存的翻译。
+// 只有当前进程的页表需要刷新：其他cpu上的旧表项由 tlb_activate()
+// 在进程回到那个cpu时刷新，还没有 ASID 的页表不会有缓存的表项。
+void
+tlb_flush_page(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(asids.max == 0 || p == 0 || p->pagetable != pagetable || p->asidgen == 0)
+    return;
+  push_off();
+  sfence_vma_page(va, p->asid);
+  tlbstat[cpuid()].page++;
+  pop_off();
+}
+
+// 同上，但丢弃 pagetable 的所有表项。
+void
+tlb_flush(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(asids.max == 0 || p == 0 || p->pagetable != pagetable || p->asidgen == 0)
+    return;
+  push_off();
+  sfence_vma_asid(p->asid);
+  tlbstat[cpuid()].asid++;
+  pop_off();
+}
+
+// 丢弃 pagetable 中 [start, end) 的表项：范围小时逐页刷新，
+// 否则刷新整个 ASID，哪种 sfence.vma 少就用哪种。
+void
+tlb_flush_range(pagetable_t pagetable, uint64 start, uint64 end)
+{
+  struct proc *p = myproc();
+
+  if(asids.max == 0 || p == 0 || p->pagetable != pagetable || p->asidgen == 0)
+    return;
+  push_off();
+  int cpu = cpuid();
+  tlbstat[cpu].range++;
+  if((end - start) / PGSIZE <= TLBFLUSH_MAX){
+    for(uint64 va = start; va < end; va += PGSIZE)
+      sfence_vma_page(va, p->asid);
+    tlbstat[cpu].page += (end - start) / PGSIZE;
+  } else {
+    sfence_vma_asid(p->asid);
+    tlbstat[cpu].asid++;
+  }
+  pop_off();
+}
+
+// 输出每个cpu的 TLB 刷新计数，供 statistics 设备使用
+int
+tlbstats(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- tlb flush stats (%d asids)\n", asids.max);
+  for(int i = 0; i < NCPU; i++){
+    n += snprintf(buf+n, sz-n, "cpu %d: page %d asid %d all %d ranges %d\n", i,
+                  (int)tlbstat[i].page, (int)tlbstat[i].asid,
+                  (int)tlbstat[i].all, (int)tlbstat[i].range);
+  }
+  return n;
+}
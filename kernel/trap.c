@@ -77,18 +77,19 @@ mmap_lazyalloc(pagetable_t pagetable, uint64 va)
     perm |= PTE_X;
   }
   // 分配物理内存，注意这里存在一个大bug，没有为所有虚拟地址分配mem(4096)的内存
-  if((mem = kalloc()) == 0){
+  // 在mmaptest/makefile()中，创建一个要映射的文件，其中包含1.5页的'A'和半页的零。
+  // 因此必须拿到一个全0的页
+  if((mem = kalloc_zeroed()) == 0){
     return -1;
   }
-  // 在mmaptest/makefile()中，创建一个要映射的文件，其中包含1.5页的'A'和半页的零。
-  // 因此，在获取mem之后，我们必须将长度的0设置为mem
-  memset(mem, 0, PGSIZE);
 
   // 将物理内存映射到虚拟地址
   if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) == -1){
     kfree(mem);
     return -1;
   }
+  // 改的是正在运行的地址空间，要刷掉 TLB 里 va 的旧表项
+  tlb_flush_page(pagetable, va);
   // 没有设置PTE_D，因为总是直接将数据写回文件中，在munmap()中进行处理
   // 读取文件数据，然后将数据放入va
   ilock(f->ip);
@@ -102,6 +103,50 @@ mmap_lazyalloc(pagetable_t pagetable, uint64 va)
   return 0;
 }
 
+// sbrk() 只移动 p->sz，堆页在第一次访问时才分配。
+// 为 va 所在的堆页分配一个全0的物理页并映射。
+// va 必须在 p->sz 之内、还没有映射，且不属于任何 mmap 区域
+// （mmap 区域由 mmap_lazyalloc 处理）。也被 copyin/copyout 使用。
+int
+lazyalloc(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+
+  if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+    return -1;
+  for(int i = 0; i < 16; i++){
+    if(p->vmas[i].addr <= va && va < (p->vmas[i].addr + p->vmas[i].length))
+      return -1;
+  }
+  va = PGROUNDDOWN(va);
+  // 已经映射（例如栈下面的保护页）：是真正的非法访问
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+
+#if HEAPSUPERPG
+  // 整个 2MB 块都在堆里且还没有任何映射时，尝试直接用一个大页
+  uint64 base = SUPERPGROUNDDOWN(va);
+  int overlap = 0;
+  for(int i = 0; i < 16; i++){
+    if(p->vmas[i].addr < base + SUPERPGSIZE && base < p->vmas[i].addr + p->vmas[i].length)
+      overlap = 1;
+  }
+  if(!overlap && base + SUPERPGSIZE <= p->sz && uvmallocsuper(pagetable, base) == 0)
+    return 0;
+#endif
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  tlb_flush_page(pagetable, va);
+  return 0;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -139,7 +184,12 @@ usertrap(void)
 
     syscall();
 
-    // Fill in the page table lazily, in response to page faults. 
+  } else if(r_scause() == 15 && cowfault(p->pagetable, r_stval()) == 0){
+    // store to a copy-on-write page; it now has a private copy.
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            lazyalloc(p->pagetable, r_stval()) == 0){
+    // Fill in the page table lazily, in response to page faults:
+    // first touch of a heap page grown by sbrk().
   } else if(r_scause() == 13){
     uint64 fault_va = r_stval();
     int is_alloc = mmap_lazyalloc(p->pagetable, fault_va);
@@ -199,8 +249,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // tagged with the process's ASID.
+  uint64 satp = tlb_activate(p);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -246,6 +297,7 @@ clockintr()
   acquire(&tickslock);
   ticks++;
   wakeup(&ticks);
+  log_tick();
   release(&tickslock);
 }
 
@@ -27,6 +27,7 @@
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific config space
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -43,9 +44,14 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
+// offset of num_queues in the virtio-blk config space
+// (struct virtio_blk_config), valid with VIRTIO_BLK_F_MQ.
+#define VIRTIO_BLK_CFG_NUM_QUEUES   34
+
+// at most this many virtio descriptors; the queue actually used is
+// the largest power of two that fits VIRTIO_MMIO_QUEUE_NUM_MAX.
 // must be a power of two.
-#define NUM 8
+#define NUM 256
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -56,12 +62,15 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr points to a table of descriptors
+
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // hint: device needn't interrupt on completion
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT while someone polls
   uint16 idx;   // driver will write ring[idx] next
-  uint16 ring[NUM]; // descriptor numbers of chain heads
+  uint16 ring[NUM]; // descriptor numbers of chain heads (first disk.num used)
   uint16 unused;
 };
 
@@ -3,7 +3,12 @@
 // uses qemu's mmio interface to virtio.
 // qemu presents a "legacy" virtio interface.
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=N
+//
+// if the device offers VIRTIO_BLK_F_MQ, each hart submits on its
+// own virtqueue (up to NCPU of them) with its own lock; blk.c
+// picks the queue. the mmio transport has a single interrupt for
+// the whole device, so the handler reaps every queue.
 //
 
 #include "types.h"
@@ -20,12 +25,19 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// how long a polled wait spins before it sleeps, in cycles of
+// the time counter (10 MHz on qemu's virt machine): 100us.
+#define POLLBUDGET 1000
+
+// one virtqueue.
+struct vq {
   // the virtio driver and device mostly communicate through a set of
-  // structures in RAM. pages[] allocates that memory. pages[] is a
-  // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // structures in RAM. pages points at that memory, which vq_init()
+  // allocates for the queues the device has. it must consist of
+  // contiguous pages of page-aligned physical memory: with NUM
+  // descriptors, one page of descriptors, the avail ring on the next
+  // page, and the used ring on the page after that.
+  char *pages;
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -34,9 +46,10 @@ static struct disk {
   
   // the first region of pages[] is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
-  // and write individual disk operations. there are NUM descriptors.
-  // most commands consist of a "chain" (a linked list) of a couple of
-  // these descriptors.
+  // and write individual disk operations. there are num descriptors.
+  // without indirect descriptors, each command is a "chain" (a linked
+  // list) of a couple of these descriptors; with them, each command
+  // takes one descriptor pointing at its table in ind[].
   // points into pages[].
   struct virtq_desc *desc;
 
@@ -54,6 +67,7 @@ static struct disk {
   struct virtq_used *used;
 
   // our own book-keeping.
+  int num;         // queue size: a power of two, <= NUM and QUEUE_NUM_MAX
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
@@ -67,19 +81,46 @@ static struct disk {
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
-  struct virtio_blk_req ops[NUM];
+  // num of them, allocated by vq_init().
+  struct virtio_blk_req *ops;
+
+  // indirect descriptor tables, one per head descriptor:
+  // header, up to NCLUSTER data segments, status.
+  // num of them, allocated by vq_init() if the device
+  // supports indirect descriptors.
+  struct virtq_desc (*ind)[NCLUSTER+2];
   
-  struct spinlock vdisk_lock;
+  // number of waiters polling; device interrupts are suppressed
+  // while it is non-zero.
+  int npolling;
+
+  struct spinlock lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+};
+
+static struct disk {
+  struct vq q[NCPU];
+  int nq;          // queues in use
+  int indirect;    // negotiated VIRTIO_RING_F_INDIRECT_DESC?
+} disk;
+
+// latency of synchronous waits, in time counter cycles.
+// updated with atomic adds.
+static struct {
+  uint npoll;      // polled waits
+  uint nspin;      // ... of which finished within POLLBUDGET
+  uint64 polltime; // total time of polled waits
+  uint nsleep;     // waits that only slept on the interrupt
+  uint64 sleeptime;
+} wstat;
+
+static void vq_init(struct vq*, int);
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 1 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -98,55 +139,114 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // keep indirect descriptors if offered: a request then costs one
+  // ring descriptor however many blocks it transfers.
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
+  // with VIRTIO_BLK_F_MQ, the config space says how many
+  // queues the device has; use up to one per hart.
+  disk.nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    disk.nq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+    if(disk.nq > NCPU)
+      disk.nq = NCPU;
+    if(disk.nq < 1)
+      disk.nq = 1;
+  }
+
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
+  for(int i = 0; i < disk.nq; i++)
+    vq_init(&disk.q[i], i);
+
+  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+}
+
+// number of virtqueues in use, for blk.c.
+int
+virtio_disk_nqueue(void)
+{
+  return disk.nq;
+}
+
+// allocate sz bytes of zeroed, physically contiguous and page-aligned
+// memory for a virtqueue: the smallest kalloc_pages() block that
+// holds it, with the pages past the end given back.
+static void*
+vq_alloc(uint64 sz)
+{
+  int order = 0;
+  uint64 npg = PGROUNDUP(sz) / PGSIZE;
+  char *pa;
+
+  while((1L << order) < npg)
+    order++;
+  if((pa = kalloc_pages(order)) == 0)
+    panic("virtio disk: out of memory");
+  ksplit(pa, order);
+  for(uint64 i = npg; i < (1L << order); i++)
+    kfree(pa + i*PGSIZE);
+  memset(pa, 0, npg*PGSIZE);
+  return pa;
+}
+
+// initialize virtqueue qn.
+static void
+vq_init(struct vq *vq, int qn)
+{
+  initlock(&vq->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = qn;
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
+    panic("virtio disk has no queue");
+  vq->num = NUM;
+  while(vq->num > max)
+    vq->num /= 2;
+  if(vq->num < (disk.indirect ? 2 : NCLUSTER+2))
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
-
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  // avail = desc + num * virtq_desc -- 2 * uint16, then num * uint16
+  // used = the next page boundary -- 2 * uint16, then num * vRingUsedElem
+
+  uint64 availsz = 2*sizeof(uint16) + vq->num*sizeof(uint16);
+  uint64 usedoff = PGROUNDUP(vq->num*sizeof(struct virtq_desc) + availsz);
+  vq->pages = vq_alloc(usedoff + 2*sizeof(uint16) + vq->num*sizeof(struct virtq_used_elem));
+  vq->ops = vq_alloc(vq->num*sizeof(vq->ops[0]));
+  if(disk.indirect)
+    vq->ind = vq_alloc(vq->num*sizeof(vq->ind[0]));
+
+  *R(VIRTIO_MMIO_QUEUE_NUM) = vq->num;
+  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)vq->pages) >> PGSHIFT;
+
+  vq->desc = (struct virtq_desc *) vq->pages;
+  vq->avail = (struct virtq_avail *)(vq->pages + vq->num*sizeof(struct virtq_desc));
+  vq->used = (struct virtq_used *) (vq->pages + usedoff);
+
+  // all num descriptors start out unused.
+  for(int i = 0; i < vq->num; i++)
+    vq->free[i] = 1;
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *vq)
 {
-  for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+  for(int i = 0; i < vq->num; i++){
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -155,28 +255,27 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *vq, int i)
 {
-  if(i >= NUM)
+  if(i >= vq->num)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,46 +283,74 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a disk transfer of k blocks uses k+2 descriptors, or just one
+// with indirect descriptors.
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vq *vq, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// queue a read or write of b, without waiting for it to finish.
+// b may be the head of a cluster: buffers linked through cnext
+// with consecutive block numbers, transferred by one request.
+// returns -1 if not enough descriptors are free; blk.c tries
+// again when a request completes. called by blk.c only, which
+// counts requests in flight through blk_complete().
+int
+virtio_disk_start(struct buf *b, int write)
 {
+  struct vq *vq = &disk.q[b->hwq];
   uint64 sector = b->blockno * (BSIZE / 512);
+  struct buf *bb;
+  int n = 0;
 
-  acquire(&disk.vdisk_lock);
+  for(bb = b; bb; bb = bb->cnext)
+    n++;
+  if(n > NCLUSTER)
+    panic("virtio_disk_start: cluster");
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, one descriptor per
+  // data segment, and one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
+  acquire(&vq->lock);
+
+  // allocate the descriptors.
+  int idx[NCLUSTER+2];
+  if(alloc_descs(vq, idx, disk.indirect ? 1 : n + 2) < 0){
+    release(&vq->lock);
+    return -1;
+  }
+
+  // d[i] is the i'th descriptor of the request and nx[i] the
+  // index that refers to it: in the indirect table of the head
+  // descriptor, or in the ring's own descriptor set.
+  struct virtq_desc *d[NCLUSTER+2];
+  uint16 nx[NCLUSTER+2];
+  for(int i = 0; i < n + 2; i++){
+    if(disk.indirect){
+      d[i] = &vq->ind[idx[0]][i];
+      nx[i] = i;
+    } else {
+      d[i] = &vq->desc[idx[i]];
+      nx[i] = idx[i];
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -232,84 +359,202 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  d[0]->addr = (uint64) buf0;
+  d[0]->len = sizeof(struct virtio_blk_req);
+  d[0]->flags = VRING_DESC_F_NEXT;
+  d[0]->next = nx[1];
+
+  int i = 1;
+  for(bb = b; bb; bb = bb->cnext, i++){
+    if(bb != b && bb->blockno != b->blockno + i - 1)
+      panic("virtio_disk_start: not contiguous");
+    d[i]->addr = (uint64) bb->data;
+    d[i]->len = BSIZE;
+    if(write)
+      d[i]->flags = 0; // device reads bb->data
+    else
+      d[i]->flags = VRING_DESC_F_WRITE; // device writes bb->data
+    d[i]->flags |= VRING_DESC_F_NEXT;
+    d[i]->next = nx[i+1];
+    bb->disk = 1;
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  vq->info[idx[0]].status = 0xff; // device writes 0 on success
+  d[i]->addr = (uint64) &vq->info[idx[0]].status;
+  d[i]->len = 1;
+  d[i]->flags = VRING_DESC_F_WRITE; // device writes the status
+  d[i]->next = 0;
+
+  if(disk.indirect){
+    // the one ring descriptor points at the table.
+    vq->desc[idx[0]].addr = (uint64) vq->ind[idx[0]];
+    vq->desc[idx[0]].len = (n + 2) * sizeof(struct virtq_desc);
+    vq->desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    vq->desc[idx[0]].next = 0;
+  }
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  vq->info[idx[0]].b = b;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  vq->avail->ring[vq->avail->idx % vq->num] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  vq->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = b->hwq; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  release(&vq->lock);
+  return 0;
+}
+
+static void virtio_disk_reap(struct vq*);
+
+// wait for a synchronous request on b to finish (see blk_wait()).
+// returns at once if b has no request in flight.
+// if poll is set, first spin for up to POLLBUDGET, reaping the used
+// ring ourselves with device interrupts suppressed, then fall back
+// to sleeping.
+void
+virtio_disk_wait(struct buf *b, int poll)
+{
+  struct vq *vq = &disk.q[b->hwq];
+  uint64 t0 = r_time();
+  int spun = 0;
+
+  acquire(&vq->lock);
+  if(b->disk == 0){
+    release(&vq->lock);
+    return;
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  if(poll){
+    b->polling = 1;
+    if(vq->npolling++ == 0)
+      vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+    release(&vq->lock);
+
+    while(b->disk && r_time() - t0 < POLLBUDGET){
+      if(vq->used->idx != vq->used_idx)
+        virtio_disk_reap(vq);
+      __sync_synchronize(); // re-read b->disk and vq->used->idx
+    }
+    spun = b->disk == 0;
+
+    acquire(&vq->lock);
+    b->polling = 0;
+    if(--vq->npolling == 0)
+      vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    release(&vq->lock);
+
+    // requests that finished while interrupts were suppressed
+    // have raised none; reap them before anyone sleeps on them.
+    virtio_disk_reap(vq);
+    acquire(&vq->lock);
+  }
 
-  release(&disk.vdisk_lock);
+  while(b->disk == 1) {
+    sleep(b, &vq->lock);
+  }
+  release(&vq->lock);
+
+  if(poll){
+    __sync_fetch_and_add(&wstat.npoll, 1);
+    if(spun)
+      __sync_fetch_and_add(&wstat.nspin, 1);
+    __sync_fetch_and_add(&wstat.polltime, r_time() - t0);
+  } else {
+    __sync_fetch_and_add(&wstat.nsleep, 1);
+    __sync_fetch_and_add(&wstat.sleeptime, r_time() - t0);
+  }
 }
 
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
-
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
+  // the interrupt doesn't say which queue; skip the idle ones
+  // without taking their locks.
+  for(int i = 0; i < disk.nq; i++)
+    if(disk.q[i].used_idx != disk.q[i].used->idx)
+      virtio_disk_reap(&disk.q[i]);
+}
+
+// process finished requests in vq's used ring: wake up synchronous
+// waiters, hand asynchronous buffers to bdone(), and tell blk.c.
+static void
+virtio_disk_reap(struct vq *vq)
+{
+  struct buf *done = 0; // finished asynchronous buffers, through cnext
+  int nreq = 0;
+
+  acquire(&vq->lock);
+
+  // the device increments vq->used->idx when it
   // adds an entry to the used ring.
 
-  while(disk.used_idx != disk.used->idx){
+  while(vq->used_idx != vq->used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = vq->used->ring[vq->used_idx % vq->num].id;
 
-    if(disk.info[id].status != 0)
+    if(vq->info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b = vq->info[id].b, *next;
+    vq->info[id].b = 0;
+    blk_account(b); // latency and trace, while the cluster is intact
+    free_chain(vq, id);
+    for(; b; b = next){
+      next = b->cnext;
+      b->cnext = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->async){
+        b->cnext = done;
+        done = b;
+      } else if(!b->polling)
+        wakeup(b);  // a polling waiter sees b->disk change by itself
+    }
+
+    vq->used_idx += 1;
+    nreq++;
+  }
+
+  release(&vq->lock);
 
-    disk.used_idx += 1;
+  // bdone() takes bcache locks; don't hold the disk lock.
+  // nobody else touches an async buffer until bdone() gives it up.
+  struct buf *b;
+  while((b = done) != 0){
+    done = b->cnext;
+    b->cnext = 0;
+    bdone(b);
   }
+  if(nreq > 0)
+    blk_complete(vq - disk.q, nreq);
+}
 
-  release(&disk.vdisk_lock);
+// print the wait latency counters, after the block queue's line
+// in the bcachestat device: polled waits, how many finished while
+// spinning, and their average time; then sleeping waits and theirs.
+int
+virtio_disk_stat(char *buf, int sz)
+{
+  return snprintf(buf, sz, "virtio: poll %d spin %d avg %d sleep %d avg %d\n",
+                  wstat.npoll, wstat.nspin,
+                  wstat.npoll ? (int)(wstat.polltime / wstat.npoll) : 0,
+                  wstat.nsleep,
+                  wstat.nsleep ? (int)(wstat.sleeptime / wstat.nsleep) : 0);
 }
@@ -21,8 +21,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -77,6 +76,9 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va is covered by a 2MB superpage, returns the level-1
+// leaf PTE instead; callers can tell by PTE_S.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -86,17 +88,36 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & PTE_S)
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Return the address of the level-1 PTE for va, where a
+// superpage leaf would go. If alloc!=0, create the level-1
+// page-table page if required.
+static pte_t *
+walksuper(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -117,16 +138,33 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(*pte & PTE_S)
+    pa += PGROUNDDOWN(va) & (SUPERPGSIZE - 1);
   return pa;
 }
 
 // add a mapping to the kernel page table.
+// the 2MB-aligned middle of the range is mapped with
+// superpages, the ragged ends with ordinary pages.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
+  uint64 end = va + sz;
+  uint64 s = SUPERPGROUNDUP(va);
+  uint64 e = SUPERPGROUNDDOWN(end);
+
+  if((va - pa) % SUPERPGSIZE != 0 || s >= e){
+    if(mappages(kpgtbl, va, sz, pa, perm) != 0)
+      panic("kvmmap");
+    return;
+  }
+  if(s > va && mappages(kpgtbl, va, s - va, pa, perm) != 0)
+    panic("kvmmap");
+  if(mappages(kpgtbl, s, e - s, pa + (s - va), perm | PTE_S) != 0)
+    panic("kvmmap");
+  if(end > e && mappages(kpgtbl, e, end - e, pa + (e - va), perm) != 0)
     panic("kvmmap");
 }
 
@@ -134,6 +172,8 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
+// With PTE_S in perm, maps 2MB superpages instead; va, pa and
+// size must then be 2MB-aligned.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
@@ -142,6 +182,19 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 
   if(size == 0)
     panic("mappages: size");
+
+  if(perm & PTE_S){
+    if((va | pa | size) % SUPERPGSIZE != 0)
+      panic("mappages: superpage alignment");
+    for(a = va; a < va + size; a += SUPERPGSIZE, pa += SUPERPGSIZE){
+      if((pte = walksuper(pagetable, a, 1)) == 0)
+        return -1;
+      if(*pte & PTE_V)
+        panic("mappages: remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+    }
+    return 0;
+  }
   
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
@@ -159,31 +212,128 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Split the user superpage whose level-1 PTE is pte into 512
+// ordinary mappings of the same physical pages, which can then
+// be unmapped and freed one at a time.
+// returns 0 on success, -1 if there is no memory for the
+// level-0 page-table page.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte) & ~PTE_S;
+
+  if((pagetable = (pagetable_t)kalloc_zeroed()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  ksplit((void*)pa, SUPERPGORDER);
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
+}
+
+// Map a zeroed 2MB superpage at va, which must be 2MB-aligned,
+// in a user page table. Nothing may be mapped in the 2MB range yet.
+// returns 0 on success, -1 if the range is in use or no
+// contiguous physical memory is free.
+int
+uvmallocsuper(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  char *mem;
+
+  if((pte = walksuper(pagetable, va, 1)) == 0 || (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc_pages(SUPERPGORDER)) == 0)
+    return -1;
+  memset(mem, 0, SUPERPGSIZE);
+  *pte = PA2PTE(mem) | PTE_W|PTE_X|PTE_R|PTE_U|PTE_S|PTE_V;
+  tlb_flush_page(pagetable, va);
+  return 0;
+}
+
+// uvmunmap() frees physical pages in batches of this many,
+// after flushing the TLB for them.
+#define UNMAP_BATCH 32
+
+// If the superpage covering va straddles va (va is not
+// 2MB-aligned), demote it. returns 0 on success, -1 if
+// there is no memory for the level-0 page-table page.
+static int
+demoteat(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va % SUPERPGSIZE == 0 || va >= MAXVA)
+    return 0;
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & (PTE_V|PTE_S)) != (PTE_V|PTE_S))
+    return 0;
+  return demote(pte);
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched (lazy sbrk)
+// have no mapping and are skipped. A superpage that is
+// only partly in the range is demoted first, before anything
+// is unmapped, so that running out of memory for the demotion
+// leaves the mappings as they were.
 // Optionally free the physical memory.
-void
+// The TLB is flushed once per batch for the range actually
+// unmapped, and only then are the batch's pages freed.
+// returns 0 on success, -1 if a superpage could not be demoted.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
   pte_t *pte;
+  void *batch[UNMAP_BATCH];
+  int n = 0;
+  uint64 lo = -1, hi = 0; // unmapped, not yet flushed: [lo, hi)
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
+  // only the superpages at the two ends can be partly in the range.
+  if(demoteat(pagetable, va) < 0 || demoteat(pagetable, va + npages*PGSIZE) < 0)
+    return -1;
+
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(*pte & PTE_S){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= va + npages*PGSIZE){
+        uint64 pa = PTE2PA(*pte);
+        *pte = 0;
+        tlb_flush_page(pagetable, a); // one TLB entry covers it all
+        if(do_free)
+          kfree_pages((void*)pa, SUPERPGORDER);
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      panic("uvmunmap: partial superpage");
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
-    }
+    if(do_free)
+      batch[n++] = (void*)PTE2PA(*pte);
     *pte = 0;
+    if(a < lo)
+      lo = a;
+    hi = a + PGSIZE;
+    if(n == UNMAP_BATCH){
+      tlb_flush_range(pagetable, lo, hi);
+      kfree_batch(batch, n);
+      n = 0;
+      lo = -1;
+      hi = 0;
+    }
   }
+  if(hi){
+    tlb_flush_range(pagetable, lo, hi);
+    kfree_batch(batch, n);
+  }
+  return 0;
 }
 
 // create an empty user page table.
@@ -192,10 +342,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -209,8 +358,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -228,12 +376,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -246,7 +393,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a
+// superpage that is only partly freed could not be demoted.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -255,7 +403,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) < 0)
+      return oldsz;
   }
 
   return newsz;
@@ -293,8 +442,10 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: the physical pages are
+// shared, and writable pages are marked copy-on-write
+// in both parent and child (see cowfault()). Superpages
+// are demoted first, so sharing is always per 4KB page.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -303,23 +454,22 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue; // not touched yet; the child will fault it in too
+    if((*pte & PTE_S) && (demote(pte) < 0 || (pte = walk(old, i, 0)) == 0))
+      goto err;
     pa = PTE2PA(*pte);
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kaddref((void*)pa);
   }
+  // the parent's writable pages just became read-only.
+  tlb_flush(old);
   return 0;
 
  err:
@@ -327,6 +477,41 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Handle a write to a copy-on-write page at va: give the page
+// table a private, writable copy of the page. If nobody else
+// shares the page any more, just make it writable again.
+// returns 0 on success, -1 if va is not a COW page or
+// memory is exhausted.
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    tlb_flush_page(pagetable, va);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  tlb_flush_page(pagetable, va);
+  kfree((void*)pa);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -347,12 +532,23 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
       return -1;
+    // the kernel writes through the direct map, so break
+    // copy-on-write sharing by hand.
+    pte = walk(pagetable, va0, 0);
+    if(pte && (*pte & PTE_COW) && cowfault(pagetable, va0) < 0)
+      return -1;
+    pa0 = walkaddr(pagetable, va0);
+    if(pa0 == 0){
+      if(lazyalloc(pagetable, va0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -376,8 +572,11 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(lazyalloc(pagetable, va0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -403,8 +602,11 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(lazyalloc(pagetable, va0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
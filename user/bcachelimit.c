@@ -0,0 +1,26 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// bcachelimit [min max]: set the buffer cache size limits
+// (0 leaves a limit unchanged) and print the number of buffers.
+int
+main(int argc, char **argv)
+{
+  int n, min = 0, max = 0;
+
+  if(argc != 1 && argc != 3){
+    fprintf(2, "usage: bcachelimit [min max]\n");
+    exit(1);
+  }
+  if(argc == 3){
+    min = atoi(argv[1]);
+    max = atoi(argv[2]);
+  }
+  if((n = bcachelimit(min, max)) < 0){
+    fprintf(2, "bcachelimit: bad limits\n");
+    exit(1);
+  }
+  printf("%d buffers\n", n);
+  exit(0);
+}
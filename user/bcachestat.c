@@ -0,0 +1,137 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// bcachestat [ticks]: sample the bcachestat device twice, ticks apart
+// (default 10), and print per-bucket occupancy plus the change in the
+// hit/miss/steal/evict counters and the average bget() time over the
+// interval and the read-ahead and eviction-by-class counters over the
+// interval, followed by the current distribution of hash chain lengths,
+// the cumulative read-ahead and eviction counters, the block request
+// queue statistics and the log's write-back state.
+//
+// echo noop > bcachestat (or deadline) switches the I/O scheduler.
+
+#define SZ 32768
+#define MAXB 256   // buckets
+#define NCOL 12    // bucket bufs free busy dirty hit miss steal evict gets time avg
+
+char buf[SZ];
+char *chains = "";   // the lines after the per-bucket rows in the last sample
+long before[MAXB][NCOL], after[MAXB][NCOL];  // time is a 64-bit cycle count
+#define NRA 4      // readahead: issued hit miss wasted
+int rabefore[NRA], raafter[NRA];
+#define NEV 3      // evict: a1 am stream
+int evbefore[NEV], evafter[NEV];
+
+// find the line in s that starts with tag and parse the n
+// "name value" pairs after the tag into v.
+// leaves v alone if there is no such line.
+void
+counters(char *s, char *tag, int *v, int n)
+{
+  int len = strlen(tag);
+
+  for(; *s; s++){
+    if((s == buf || s[-1] == '\n') && memcmp(s, tag, len) == 0)
+      break;
+  }
+  if(*s == 0)
+    return;
+  s += len;
+  for(int i = 0; i < n; i++){
+    while(*s == ' ')
+      s++;
+    while(*s && *s != ' ' && *s != '\n')  // the name
+      s++;
+    while(*s == ' ')
+      s++;
+    for(v[i] = 0; *s >= '0' && *s <= '9'; s++)
+      v[i] = v[i]*10 + *s - '0';
+  }
+}
+
+// read the device and parse one row of numbers per bucket,
+// the read-ahead counters into ra and the eviction counters into ev.
+// returns the number of buckets; leaves chains pointing at the
+// chain length histogram and the lines after it.
+int
+sample(long rows[MAXB][NCOL], int ra[NRA], int ev[NEV])
+{
+  int fd, i, n, r, c, neg;
+  long v;
+  char *p;
+
+  if((fd = open("bcachestat", O_RDONLY)) < 0){
+    fprintf(2, "bcachestat: open failed\n");
+    exit(1);
+  }
+  for(i = 0; i < SZ-1; i += n)
+    if((n = read(fd, buf+i, SZ-1-i)) <= 0)
+      break;
+  close(fd);
+  buf[i] = 0;
+  counters(buf, "--- bcache readahead:", ra, NRA);
+  counters(buf, "--- bcache evict:", ev, NEV);
+
+  p = strchr(buf, '\n');   // skip the header line
+  if(p == 0)
+    return 0;
+  p++;
+  for(r = 0; r < MAXB && *p >= '0' && *p <= '9'; r++){
+    for(c = 0; c < NCOL; c++){
+      while(*p == ' ')
+        p++;
+      neg = *p == '-';
+      if(neg)
+        p++;
+      for(v = 0; *p >= '0' && *p <= '9'; p++)
+        v = v*10 + *p - '0';
+      rows[r][c] = neg ? -v : v;
+    }
+    while(*p && *p != '\n')
+      p++;
+    if(*p)
+      p++;
+  }
+  chains = p;
+  return r;
+}
+
+int
+main(int argc, char **argv)
+{
+  int n, ticks = 10;
+
+  if(argc > 2){
+    fprintf(2, "usage: bcachestat [ticks]\n");
+    exit(1);
+  }
+  if(argc == 2)
+    ticks = atoi(argv[1]);
+
+  sample(before, rabefore, evbefore);
+  sleep(ticks);
+  n = sample(after, raafter, evafter);
+
+  printf("bucket bufs free busy dirty   hit  miss steal evict  gets avg\n");
+  for(int r = 0; r < n; r++){
+    long *a = after[r], *b = before[r];
+    int gets = a[9] - b[9];
+    long dt = a[10] - b[10];
+    printf("%d %d %d %d %d   %d %d %d %d  %d %d\n",
+           (int)a[0], (int)a[1], (int)a[2], (int)a[3], (int)a[4],
+           (int)(a[5]-b[5]), (int)(a[6]-b[6]), (int)(a[7]-b[7]), (int)(a[8]-b[8]),
+           gets, gets ? (int)(dt / gets) : 0);
+  }
+  printf("readahead: issued %d hit %d miss %d wasted %d\n",
+         raafter[0]-rabefore[0], raafter[1]-rabefore[1],
+         raafter[2]-rabefore[2], raafter[3]-rabefore[3]);
+  printf("evict: a1 %d am %d stream %d\n",
+         evafter[0]-evbefore[0], evafter[1]-evbefore[1], evafter[2]-evbefore[2]);
+  // buckets with 0, 1, 2, ... buffers on their hash chain,
+  // then the cumulative counters and the block request queue
+  printf("%s", chains);
+  exit(0);
+}
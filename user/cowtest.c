@@ -0,0 +1,390 @@
+//
+// tests for copy-on-write fork()
+//
+
+#include "kernel/types.h"
+#include "kernel/memlayout.h"
+#include "user/user.h"
+
+#define SBRKFAIL ((char*)0xffffffffffffffffL)
+
+// allocate and touch more than half of physical memory, then fork.
+// without copy-on-write the child would need a second copy and
+// fork() would fail.
+void
+simpletest()
+{
+  uint64 phys_size = PHYSTOP - KERNBASE;
+  int sz = (phys_size / 3) * 2;
+
+  printf("simple: ");
+
+  char *p = sbrk(sz);
+  if(p == SBRKFAIL){
+    printf("sbrk(%d) failed\n", sz);
+    exit(1);
+  }
+
+  // sbrk() is lazy; make every page resident.
+  for(char *q = p; q < p + sz; q += 4096){
+    *(int*)q = getpid();
+  }
+
+  int pid = fork();
+  if(pid < 0){
+    printf("fork() failed\n");
+    exit(1);
+  }
+
+  if(pid == 0)
+    exit(0);
+
+  wait(0);
+
+  if(sbrk(-sz) == SBRKFAIL){
+    printf("sbrk(-%d) failed\n", sz);
+    exit(1);
+  }
+
+  printf("ok\n");
+}
+
+// three processes write the same large region at the same time,
+// each must see only its own writes.
+void
+threetest()
+{
+  uint64 phys_size = PHYSTOP - KERNBASE;
+  int sz = phys_size / 4;
+  int pid1, pid2;
+
+  printf("three: ");
+
+  char *p = sbrk(sz);
+  if(p == SBRKFAIL){
+    printf("sbrk(%d) failed\n", sz);
+    exit(1);
+  }
+  for(char *q = p; q < p + sz; q += 4096){
+    *(int*)q = 1;
+  }
+
+  pid1 = fork();
+  if(pid1 < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid1 == 0){
+    pid2 = fork();
+    if(pid2 < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid2 == 0){
+      for(char *q = p; q < p + (sz/5)*4; q += 4096){
+        *(int*)q = getpid();
+      }
+      for(char *q = p; q < p + (sz/5)*4; q += 4096){
+        if(*(int*)q != getpid()){
+          printf("wrong content\n");
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+    for(char *q = p; q < p + (sz/2); q += 4096){
+      *(int*)q = 9999;
+    }
+    int xstatus;
+    wait(&xstatus);
+    exit(xstatus);
+  }
+
+  for(char *q = p; q < p + sz; q += 4096){
+    *(int*)q = getpid();
+  }
+
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  for(char *q = p; q < p + sz; q += 4096){
+    if(*(int*)q != getpid()){
+      printf("wrong content\n");
+      exit(1);
+    }
+  }
+
+  if(sbrk(-sz) == SBRKFAIL){
+    printf("sbrk(-%d) failed\n", sz);
+    exit(1);
+  }
+
+  printf("ok\n");
+}
+
+char page[4096] __attribute__((aligned(4096)));
+
+// parent and child write the same shared page. the child must
+// see the parent's data until it writes, and neither may see
+// the other's writes. after the child exits the parent is the
+// only user of its copy, and writes to it must still work.
+void
+samepagetest()
+{
+  int tochild[2], toparent[2];
+  char c;
+
+  printf("same page: ");
+
+  page[0] = 'p';
+  page[4095] = 'p';
+  if(pipe(tochild) < 0 || pipe(toparent) < 0){
+    printf("pipe() failed\n");
+    exit(1);
+  }
+
+  int pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    if(page[0] != 'p' || page[4095] != 'p'){
+      printf("child sees wrong content before writing\n");
+      exit(1);
+    }
+    page[0] = 'c';
+    // let the parent write its copy, then check ours.
+    if(write(toparent[1], "x", 1) != 1 || read(tochild[0], &c, 1) != 1){
+      printf("pipe failed\n");
+      exit(1);
+    }
+    if(page[0] != 'c' || page[4095] != 'p'){
+      printf("child sees parent's write\n");
+      exit(1);
+    }
+    exit(0);
+  }
+
+  if(read(toparent[0], &c, 1) != 1){
+    printf("pipe failed\n");
+    exit(1);
+  }
+  page[4095] = 'P';
+  if(write(tochild[1], "x", 1) != 1){
+    printf("pipe failed\n");
+    exit(1);
+  }
+
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(page[0] != 'p' || page[4095] != 'P'){
+    printf("parent sees child's write\n");
+    exit(1);
+  }
+  page[0] = 'q';
+  if(page[0] != 'q'){
+    printf("write after child exit lost\n");
+    exit(1);
+  }
+  close(tochild[0]);
+  close(tochild[1]);
+  close(toparent[0]);
+  close(toparent[1]);
+
+  printf("ok\n");
+}
+
+char junk1[4096];
+int fds[2];
+char junk2[4096];
+char buf[4096];
+char junk3[4096];
+
+// the kernel's copyout() must break copy-on-write
+// sharing when read() writes into a shared page.
+void
+filetest()
+{
+  printf("file: ");
+
+  buf[0] = 99;
+
+  for(int i = 0; i < 4; i++){
+    if(pipe(fds) != 0){
+      printf("pipe() failed\n");
+      exit(1);
+    }
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      sleep(1);
+      if(read(fds[0], buf, sizeof(i)) != sizeof(i)){
+        printf("error: read failed\n");
+        exit(1);
+      }
+      sleep(1);
+      int j = *(int*)buf;
+      if(j != i){
+        printf("error: read the wrong value\n");
+        exit(1);
+      }
+      exit(0);
+    }
+    if(write(fds[1], &i, sizeof(i)) != sizeof(i)){
+      printf("error: write failed\n");
+      exit(1);
+    }
+  }
+
+  int xstatus = 0;
+  for(int i = 0; i < 4; i++) {
+    wait(&xstatus);
+    if(xstatus != 0) {
+      exit(1);
+    }
+  }
+
+  if(buf[0] != 99){
+    printf("error: child overwrote parent\n");
+    exit(1);
+  }
+
+  printf("ok\n");
+}
+
+// count the free pages by having a child grow its heap one
+// touched page at a time until the kernel kills it.
+int
+countfree()
+{
+  int fds[2];
+
+  if(pipe(fds) < 0){
+    printf("pipe() failed in countfree()\n");
+    exit(1);
+  }
+
+  int pid = fork();
+  if(pid < 0){
+    printf("fork failed in countfree()\n");
+    exit(1);
+  }
+
+  if(pid == 0){
+    close(fds[0]);
+    while(1){
+      char *a = sbrk(4096);
+      if(a == SBRKFAIL)
+        break;
+      // make sure the page is really allocated.
+      a[4096 - 1] = 1;
+      if(write(fds[1], "x", 1) != 1){
+        printf("write() failed in countfree()\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+
+  close(fds[1]);
+
+  int n = 0;
+  while(1){
+    char c;
+    int cc = read(fds[0], &c, 1);
+    if(cc < 0){
+      printf("read() failed in countfree()\n");
+      exit(1);
+    }
+    if(cc == 0)
+      break;
+    n += 1;
+  }
+
+  close(fds[0]);
+  wait((int*)0);
+  return n;
+}
+
+// fork many children that share, copy and free pages;
+// when they are gone every page must be free again.
+void
+forks(int n)
+{
+  char *p = sbrk(64*4096);
+  if(p == SBRKFAIL){
+    printf("sbrk failed\n");
+    exit(1);
+  }
+  for(char *q = p; q < p + 64*4096; q += 4096)
+    *q = 1;
+
+  for(int i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      // copy half the pages, leave the rest shared
+      for(char *q = p; q < p + 32*4096; q += 4096)
+        *q = 2;
+      exit(0);
+    }
+    wait(0);
+  }
+
+  if(sbrk(-64*4096) == SBRKFAIL){
+    printf("sbrk failed\n");
+    exit(1);
+  }
+}
+
+void
+freetest()
+{
+  printf("free pages: ");
+
+  // the first round may leave slabs and such allocated for good.
+  forks(10);
+  int free0 = countfree();
+  forks(100);
+  int free1 = countfree();
+  if(free1 < free0){
+    printf("lost %d free pages\n", free0 - free1);
+    exit(1);
+  }
+
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  simpletest();
+
+  // check that the first simpletest() freed the physical memory.
+  simpletest();
+
+  threetest();
+  threetest();
+  threetest();
+
+  samepagetest();
+
+  filetest();
+
+  freetest();
+
+  printf("ALL COW TESTS PASSED\n");
+
+  exit(0);
+}
@@ -14,13 +14,22 @@ char *argv[] = { "sh", 0 };
 int
 main(void)
 {
-  int pid, wpid;
+  int pid, wpid, fd;
 
   if(open("console", O_RDWR) < 0){
     mknod("console", CONSOLE, 0);
     mknod("statistics", STATS, 0);
     open("console", O_RDWR);
   }
+  // 旧的文件系统镜像里可能还没有这些设备文件
+  if((fd = open("bcachestat", O_RDONLY)) < 0)
+    mknod("bcachestat", BCACHESTAT, 0);
+  else
+    close(fd);
+  if((fd = open("iostat", O_RDONLY)) < 0)
+    mknod("iostat", IOSTAT, 0);
+  else
+    close(fd);
   dup(0);  // stdout
   dup(0);  // stderr
 
@@ -0,0 +1,108 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// iostat [-t]: print the block I/O latency histograms from the
+// iostat device, one per kind of request (read/write x log/meta/data),
+// as counts per latency range. with -t, also dump the recent requests
+// each CPU recorded: CPU, submit time (ms since boot), block number,
+// number of blocks, op, class, queue time and device time.
+//
+// the kernel keeps times in cycles of the time counter; qemu's virt
+// machine runs it at 10 MHz, so 10 cycles are 1us.
+
+#define SZ 32768
+#define NHIST 32
+#define CYCLES_PER_US 10
+
+char buf[SZ];
+
+// parse a decimal number at *pp and advance past it and the spaces after.
+int
+number(char **pp)
+{
+  char *p = *pp;
+  int v = 0;
+
+  for(; *p >= '0' && *p <= '9'; p++)
+    v = v*10 + *p - '0';
+  while(*p == ' ')
+    p++;
+  *pp = p;
+  return v;
+}
+
+// copy the word at *pp into w and advance past it and the spaces after.
+void
+word(char **pp, char *w, int max)
+{
+  char *p = *pp;
+  int i = 0;
+
+  for(; *p && *p != ' ' && *p != '\n'; p++)
+    if(i < max-1)
+      w[i++] = *p;
+  w[i] = 0;
+  while(*p == ' ')
+    p++;
+  *pp = p;
+}
+
+// print one "hist op class count avg b0 .. b31" line.
+void
+hist(char *p)
+{
+  char op[8], class[8];
+  int count, avg, b;
+
+  word(&p, op, sizeof(op));
+  word(&p, class, sizeof(class));
+  count = number(&p);
+  avg = number(&p);
+  if(count == 0)
+    return;
+  printf("%s %s: %d requests, avg %d us\n", op, class, count, avg / CYCLES_PER_US);
+  for(int i = 0; i < NHIST; i++){
+    b = number(&p);
+    if(b)
+      printf("  %d-%d us: %d\n", (int)(((uint64)1 << i) / CYCLES_PER_US),
+             (int)(((uint64)2 << i) / CYCLES_PER_US), b);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int fd, i, n, tr = 0;
+  char *p, *nl;
+
+  if(argc > 2 || (argc == 2 && strcmp(argv[1], "-t") != 0)){
+    fprintf(2, "usage: iostat [-t]\n");
+    exit(1);
+  }
+  tr = argc == 2;
+
+  if((fd = open("iostat", O_RDONLY)) < 0){
+    fprintf(2, "iostat: open failed\n");
+    exit(1);
+  }
+  for(i = 0; i < SZ-1; i += n)
+    if((n = read(fd, buf+i, SZ-1-i)) <= 0)
+      break;
+  close(fd);
+  buf[i] = 0;
+
+  if(tr)
+    printf("trace cpu ms block n op class queue device\n");
+  for(p = buf; *p; p = nl + 1){
+    if((nl = strchr(p, '\n')) == 0)
+      break;
+    *nl = 0;
+    if(memcmp(p, "hist ", 5) == 0)
+      hist(p + 5);
+    else if(tr && memcmp(p, "trace ", 6) == 0)
+      printf("%s\n", p);
+  }
+  exit(0);
+}
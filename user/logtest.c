@@ -0,0 +1,155 @@
+//
+// test that committed but not yet written back log blocks
+// survive a crash.
+//
+// logtest w: stop the log flusher from writing back, then rewrite
+//            the same file block in several transactions, so that the
+//            block is in the log several times, and check through the
+//            bcachestat device that it has not been written back. the
+//            write-back settings are restored before exiting. run this,
+//            then kill qemu without a clean shutdown.
+// logtest r: after rebooting, recovery must have installed the
+//            last version of the block.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define NVERSION 3
+
+char buf[BSIZE];
+char dev[32768];
+
+// the "log:" line of the bcachestat device
+#define NLOG 5     // committed pending age flushage dirtyratio
+#define COMMITTED 0
+#define FLUSHAGE 3
+#define DIRTYRATIO 4
+int saved[NLOG];
+
+// read the log's write-back state from the bcachestat device into v.
+void
+logstate(int *v)
+{
+  int fd, i, n;
+  char *s;
+
+  if((fd = open("bcachestat", O_RDONLY)) < 0){
+    printf("logtest: cannot open bcachestat\n");
+    exit(1);
+  }
+  for(i = 0; i < sizeof(dev)-1; i += n)
+    if((n = read(fd, dev+i, sizeof(dev)-1-i)) <= 0)
+      break;
+  close(fd);
+  dev[i] = 0;
+
+  for(s = dev; *s; s++)
+    if((s == dev || s[-1] == '\n') && memcmp(s, "log:", 4) == 0)
+      break;
+  if(*s == 0){
+    printf("logtest: no log state in bcachestat\n");
+    exit(1);
+  }
+  s += 4;
+  for(i = 0; i < NLOG; i++){
+    while(*s == ' ')
+      s++;
+    while(*s && *s != ' ' && *s != '\n')  // the name
+      s++;
+    while(*s == ' ')
+      s++;
+    for(v[i] = 0; *s >= '0' && *s <= '9'; s++)
+      v[i] = v[i]*10 + *s - '0';
+  }
+}
+
+// put back the write-back settings writes() changed, then exit.
+void
+done(int status)
+{
+  logtune(saved[FLUSHAGE], saved[DIRTYRATIO]);
+  exit(status);
+}
+
+void
+writes(void)
+{
+  int fd;
+  int v[NLOG];
+
+  logstate(saved);
+  // write back nothing until the log is full.
+  if(logtune(1000000, 100) < 0){
+    printf("logtest: logtune failed\n");
+    exit(1);
+  }
+  unlink("logtest.f");
+  for(int i = 0; i < NVERSION; i++){
+    if((fd = open("logtest.f", O_CREATE|O_WRONLY)) < 0){
+      printf("logtest: open failed\n");
+      done(1);
+    }
+    memset(buf, 'a' + i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("logtest: write failed\n");
+      done(1);
+    }
+    close(fd);
+  }
+
+  // the home blocks must still be stale: everything is in the log.
+  logstate(v);
+  if(v[COMMITTED] == 0){
+    printf("logtest: committed blocks already written back\n");
+    done(1);
+  }
+  printf("logtest: committed\n");
+  done(0);
+}
+
+void
+check(void)
+{
+  int fd;
+  struct stat st;
+
+  if((fd = open("logtest.f", O_RDONLY)) < 0){
+    printf("logtest: file lost\n");
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != BSIZE){
+    printf("logtest: wrong size %d\n", (int)st.size);
+    exit(1);
+  }
+  if(read(fd, buf, BSIZE) != BSIZE){
+    printf("logtest: read failed\n");
+    exit(1);
+  }
+  close(fd);
+  for(int i = 0; i < BSIZE; i++){
+    if(buf[i] != 'a' + NVERSION - 1){
+      printf("logtest: byte %d is %c, not %c\n", i, buf[i], 'a' + NVERSION - 1);
+      exit(1);
+    }
+  }
+  unlink("logtest.f");
+  printf("logtest: ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc != 2 || (strcmp(argv[1], "w") != 0 && strcmp(argv[1], "r") != 0)){
+    fprintf(2, "usage: logtest w|r\n");
+    exit(1);
+  }
+  if(strcmp(argv[1], "w") == 0)
+    writes();
+  else
+    check();
+  exit(0);
+}
@@ -29,6 +29,8 @@ int uptime(void);
 void *mmap(void *addr, int length, int prot, int flags,
            int fd, int offset);
 int munmap(void *addr, int length);
+int bcachelimit(int, int);
+int logtune(int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -2617,6 +2617,177 @@ sbrk8000(char *s)
   *(top-1) = *(top-1) + 1;
 }
 
+// sbrk() only reserves address space; pages are allocated on
+// first touch. grow the heap far beyond physical memory and
+// touch a few scattered pages.
+void
+lazybig(char *s)
+{
+  int sz = 1 << 30;
+  char *a, *p;
+
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1);
+  }
+  for(p = a; p < a + sz; p += 64*1024*1024)
+    *p = 'x';
+  a[sz-1] = 'y';
+  for(p = a; p < a + sz; p += 64*1024*1024){
+    if(*p != 'x'){
+      printf("%s: lost a write\n", s);
+      exit(1);
+    }
+  }
+  if(a[sz-1] != 'y' || a[sz-2] != 0){
+    printf("%s: wrong content\n", s);
+    exit(1);
+  }
+  if(sbrk(-sz) != a + sz){
+    printf("%s: sbrk(-%d) failed\n", s, sz);
+    exit(1);
+  }
+}
+
+// shrink the heap over pages that were never touched, and over
+// a mix of touched and untouched ones.
+void
+lazyunmap(char *s)
+{
+  char *a, *b;
+
+  a = sbrk(0);
+  for(int i = 0; i < 10; i++){
+    b = sbrk(100*PGSIZE);
+    if(b != a){
+      printf("%s: sbrk returned %p, not %p\n", s, b, a);
+      exit(1);
+    }
+    if(i & 1)
+      b[50*PGSIZE] = 1;
+    if(sbrk(-100*PGSIZE) == (char*)0xffffffffffffffffL || sbrk(0) != a){
+      printf("%s: sbrk(-n) failed\n", s);
+      exit(1);
+    }
+  }
+  // the pages must be zero-filled when they come back.
+  b = sbrk(100*PGSIZE);
+  if(b[50*PGSIZE] != 0){
+    printf("%s: page not zeroed\n", s);
+    exit(1);
+  }
+}
+
+// system calls that read or write an untouched heap page must
+// allocate it in copyin()/copyout() instead of failing.
+void
+lazysyscall(char *s)
+{
+  char *a;
+  int fd, fds[2];
+
+  a = sbrk(4*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  // write() from an untouched page: copyin() reads zeros.
+  unlink("lazy");
+  fd = open("lazy", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(write(fd, a, PGSIZE) != PGSIZE){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read() into an untouched page.
+  memset(buf, 'x', PGSIZE);
+  fd = open("lazy", O_RDONLY);
+  if(fd < 0 || read(fd, buf, PGSIZE) != PGSIZE){
+    printf("%s: read back failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("lazy");
+  for(int i = 0; i < PGSIZE; i++){
+    if(buf[i] != 0){
+      printf("%s: untouched page was not zero\n", s);
+      exit(1);
+    }
+  }
+  fd = open("README", O_RDONLY);
+  if(fd < 0 || read(fd, a + PGSIZE, PGSIZE) != PGSIZE){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(a[PGSIZE] == 0){
+    printf("%s: read left the page empty\n", s);
+    exit(1);
+  }
+
+  // pipe() writes its fds into an untouched page.
+  if(pipe((int*)(a + 2*PGSIZE)) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  memmove(fds, a + 2*PGSIZE, sizeof(fds));
+  if(write(fds[1], "z", 1) != 1 || read(fds[0], a + 3*PGSIZE, 1) != 1 || a[3*PGSIZE] != 'z'){
+    printf("%s: pipe i/o failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// touching memory past the end of the heap must kill the
+// process, and system calls given such an address must fail.
+void
+lazypastsz(char *s)
+{
+  uint64 top;
+  int pid, xstatus, fd;
+
+  top = (uint64) sbrk(0);
+  if((top % PGSIZE) != 0)
+    sbrk(PGSIZE - (top % PGSIZE));
+  sbrk(PGSIZE);
+  top = (uint64) sbrk(0);
+
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(read(fd, (char*)(top + PGSIZE), 1) != -1){
+    printf("%s: read() past sz succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(uint64 a = top; a < top + 4*PGSIZE; a += PGSIZE){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      *(volatile char*)a = 1;
+      printf("%s: write to %p past sz did not kill\n", s, a);
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != -1)
+      exit(1);
+  }
+}
+
 // regression test. does write() with an invalid buffer pointer cause
 // a block to be allocated for a file that is then not freed when the
 // file is deleted? if the kernel has this bug, it will panic: balloc:
@@ -2833,6 +3004,10 @@ main(int argc, char *argv[])
     {reparent2, "reparent2"},
     {pgbug, "pgbug" },
     {sbrkbugs, "sbrkbugs" },
+    {lazybig, "lazybig" },
+    {lazyunmap, "lazyunmap" },
+    {lazysyscall, "lazysyscall" },
+    {lazypastsz, "lazypastsz" },
     // {badwrite, "badwrite" },
     {badarg, "badarg" },
     {reparent, "reparent" },
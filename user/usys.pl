@@ -37,4 +37,6 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("mmap");
-entry("munmap");
\ No newline at end of file
+entry("munmap");
+entry("bcachelimit");
+entry("logtune");
\ No newline at end of file